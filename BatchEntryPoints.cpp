@@ -0,0 +1,83 @@
+#include "BatchEntryPoints.hpp"
+
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Module.h>
+
+namespace {
+
+bool isScalar(const llvm::Type *T) { return T->isIntegerTy() || T->isFloatingPointTy(); }
+
+llvm::Error batchEntryPointError(const llvm::Function &F, const llvm::Twine &Reason) {
+  return llvm::make_error<llvm::StringError>(
+      "Cannot create a batch entry point for " + F.getName() + ": " + Reason,
+      llvm::inconvertibleErrorCode());
+}
+
+}  // anonymous namespace
+
+llvm::Expected<llvm::Function *> createBatchEntryPoint(llvm::Function &F) {
+  if (F.isDeclaration()) return batchEntryPointError(F, "it is not defined in this module");
+  if (F.isVarArg()) return batchEntryPointError(F, "it is variadic");
+  if (!isScalar(F.getReturnType())) return batchEntryPointError(F, "it does not return a scalar");
+  for (const llvm::Argument &Arg : F.args()) {
+    if (!isScalar(Arg.getType())) return batchEntryPointError(F, "it has a non scalar argument");
+  }
+
+  llvm::Module &M = *F.getParent();
+  const std::string BatchName = F.getName().str() + "_batch";
+  if (M.getNamedValue(BatchName)) return batchEntryPointError(F, BatchName + " already exists");
+
+  llvm::LLVMContext &Ctx = M.getContext();
+  llvm::Type *PtrType = llvm::PointerType::get(Ctx, 0);
+  llvm::Type *Int64Type = llvm::Type::getInt64Ty(Ctx);
+  // one input array per scalar argument, then the output array and the number of elements
+  std::vector<llvm::Type *> ParamTypes(F.arg_size() + 1, PtrType);
+  ParamTypes.push_back(Int64Type);
+  llvm::FunctionType *BatchType =
+      llvm::FunctionType::get(llvm::Type::getVoidTy(Ctx), ParamTypes, false);
+  llvm::Function *Batch =
+      llvm::Function::Create(BatchType, llvm::Function::ExternalLinkage, BatchName, M);
+
+  const unsigned NumInputs = F.arg_size();
+  for (unsigned I = 0; I < NumInputs; I++) {
+    llvm::Argument *In = Batch->getArg(I);
+    In->setName(F.getArg(I)->hasName() ? F.getArg(I)->getName() : "in");
+    In->addAttr(llvm::Attribute::NoAlias);
+    In->addAttr(llvm::Attribute::NoCapture);
+    In->addAttr(llvm::Attribute::ReadOnly);
+  }
+  llvm::Argument *Out = Batch->getArg(NumInputs);
+  Out->setName("out");
+  Out->addAttr(llvm::Attribute::NoAlias);
+  Out->addAttr(llvm::Attribute::NoCapture);
+  Out->addAttr(llvm::Attribute::WriteOnly);
+  llvm::Argument *Count = Batch->getArg(NumInputs + 1);
+  Count->setName("n");
+
+  llvm::BasicBlock *EntryBB = llvm::BasicBlock::Create(Ctx, "entry", Batch);
+  llvm::BasicBlock *LoopBB = llvm::BasicBlock::Create(Ctx, "loop", Batch);
+  llvm::BasicBlock *ExitBB = llvm::BasicBlock::Create(Ctx, "exit", Batch);
+  llvm::IRBuilder<> Builder(EntryBB);
+  llvm::Value *Zero = llvm::ConstantInt::get(Int64Type, 0);
+  Builder.CreateCondBr(Builder.CreateICmpSGT(Count, Zero), LoopBB, ExitBB);
+
+  Builder.SetInsertPoint(LoopBB);
+  llvm::PHINode *Index = Builder.CreatePHI(Int64Type, 2, "index");
+  std::vector<llvm::Value *> Args;
+  for (unsigned I = 0; I < NumInputs; I++) {
+    llvm::Type *ArgType = F.getArg(I)->getType();
+    Args.push_back(
+        Builder.CreateLoad(ArgType, Builder.CreateInBoundsGEP(ArgType, Batch->getArg(I), Index)));
+  }
+  llvm::CallInst *Result = Builder.CreateCall(&F, Args);
+  Result->addFnAttr(llvm::Attribute::AlwaysInline);
+  Builder.CreateStore(Result, Builder.CreateInBoundsGEP(F.getReturnType(), Out, Index));
+  llvm::Value *NextIndex = Builder.CreateNUWAdd(Index, llvm::ConstantInt::get(Int64Type, 1));
+  Index->addIncoming(Zero, EntryBB);
+  Index->addIncoming(NextIndex, LoopBB);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(NextIndex, Count), ExitBB, LoopBB);
+
+  Builder.SetInsertPoint(ExitBB);
+  Builder.CreateRetVoid();
+  return Batch;
+}
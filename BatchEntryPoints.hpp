@@ -0,0 +1,26 @@
+#ifndef BATCH_ENTRY_POINTS_HPP
+#define BATCH_ENTRY_POINTS_HPP
+
+#include <llvm/IR/Function.h>
+#include <llvm/Support/Error.h>
+
+/**
+ * Create a batch entry point for the scalar function F in F's module, so that callers can process
+ * a whole column per call instead of making one indirect call per element. For
+ *
+ *   T F(A0 a0, A1 a1, ...)
+ *
+ * where T and every Ai are integer or floating point types, this creates
+ *
+ *   void F_batch(const A0 *a0, const A1 *a1, ..., T *out, i64 n)
+ *
+ * which computes out[i] = F(a0[i], a1[i], ...) for i in [0, n). The call to F is marked
+ * alwaysinline so that optimization leaves a plain loop that the loop vectorizer can handle. The
+ * input and output arrays must not overlap.
+ *
+ * @param F The scalar function, it must be defined in its module
+ * @return The batch entry point, or an error if F is not a scalar function
+ */
+llvm::Expected<llvm::Function *> createBatchEntryPoint(llvm::Function &F);
+
+#endif  // BATCH_ENTRY_POINTS_HPP
@@ -24,6 +24,7 @@
 #include "llvm/IR/DIBuilder.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/DebugInfo.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstVisitor.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/LLVMContext.h"
@@ -59,11 +60,10 @@ class ValueToLineMap : public AssemblyAnnotationWriter {
   }
 
  public:
-  /// Prints Module to a null buffer in order to build the map of Value pointers
-  /// to line numbers.
-  ValueToLineMap(const Module *M) {
-    raw_null_ostream ThrowAway;
-    M->print(ThrowAway, this);
+  /// Prints Module to Out, the same way the IR file is printed, building the
+  /// map of Value pointers to line numbers as it goes.
+  ValueToLineMap(const Module *M, raw_ostream &Out) {
+    M->print(Out, this, /*ShouldPreserveUseListOrder=*/false, /*IsForDebug=*/true);
   }
 
   // This function is called after an Instruction, GlobalValue, or GlobalAlias
@@ -102,14 +102,11 @@ class DIUpdater : public InstVisitor<DIUpdater> {
   DataLayout Layout;
 
   /// Map of Value* to line numbers
-  const ValueToLineMap LineTable;
+  const ValueToLineMap &LineTable;
 
   /// Map of Value* (in original Module) to Value* (in optional cloned Module)
   const ValueToValueMapTy *VMap;
 
-  /// Directory of debug metadata
-  DebugInfoFinder Finder;
-
   /// Source filename and directory
   StringRef Filename;
   StringRef Directory;
@@ -126,21 +123,20 @@ class DIUpdater : public InstVisitor<DIUpdater> {
   DenseMap<const Type *, DIType *> TypeDescriptors;
 
  public:
-  DIUpdater(Module &M, StringRef Filename = StringRef(), StringRef Directory = StringRef(),
-            const Module *DisplayM = nullptr, const ValueToValueMapTy *VMap = nullptr)
+  /// M must not have any debug info, and LineTable must have been built from
+  /// M as it is now.
+  DIUpdater(Module &M, const ValueToLineMap &LineTable, StringRef Filename,
+            StringRef Directory, const ValueToValueMapTy *VMap = nullptr)
       : Builder(M),
         Layout(&M),
-        LineTable(DisplayM ? DisplayM : &M),
+        LineTable(LineTable),
         VMap(VMap),
-        Finder(),
         Filename(Filename),
         Directory(Directory),
         FileNode(nullptr),
         LexicalBlockFileNode(nullptr),
         M(M),
         tempNameCounter(0) {
-    // Even without finder, this screws up.
-    Finder.processModule(M);
     visit(&M);
   }
 
@@ -148,13 +144,9 @@ class DIUpdater : public InstVisitor<DIUpdater> {
 
   void visitModule(Module &M) {
     (void)M;
-    if (Finder.compile_unit_count() > 1)
-      report_fatal_error(
-          "DebugIR pass supports only a signle compile unit per "
-          "Module.");
-    createCompileUnit(Finder.compile_unit_count() == 1
-                          ? (DICompileUnit *)*Finder.compile_units().begin()
-                          : nullptr);
+    // the module is stripped of debug info before it is updated, so there is no
+    // compile unit to reuse
+    createCompileUnit(nullptr);
   }
 
   void visitFunction(Function &F) {
@@ -326,18 +318,8 @@ class DIUpdater : public InstVisitor<DIUpdater> {
     FuncNodeIter i = SubprogramDescriptors.find(F);
     if (i != SubprogramDescriptors.end()) return i->second;
 
-    LLVM_DEBUG(dbgs() << "searching for DI scope node for Function " << F << " in a list of "
-                      << Finder.subprogram_count() << " subprogram nodes" << "\n");
-
-    // TODO: When would this even be reached?
-    for (DISubprogram *S : Finder.subprograms()) {
-      // TODO: Is describes correct?
-      if (S->describes(F)) {
-        LLVM_DEBUG(dbgs() << "Found DISubprogram " << S << " for function " << F->getName()
-                          << "\n");
-        return S;
-      }
-    }
+    // Functions are stripped of debug info before being updated, so any other
+    // subprogram attached to F is not one of ours.
     LLVM_DEBUG(dbgs() << "unable to find DISubprogram node for function " << F->getName().str()
                       << "\n");
     return nullptr;
@@ -469,19 +451,31 @@ class DIUpdater : public InstVisitor<DIUpdater> {
 
 namespace llvm {
 
-void createDebugInfo(Module &M, std::string Directory, std::string Filename) {
+Error createDebugInfo(Module &M, raw_ostream &Out, std::string Directory, std::string Filename,
+                      bool Verify) {
   StripDebugInfo(M);
   {
+    // The line table flushes the stream after every value it records, which
+    // would be a write per instruction to a file, so print to a string first.
+    std::string Text;
+    raw_string_ostream TextStream(Text);
+    const ValueToLineMap LineTable(&M, TextStream);
+    Out << TextStream.str();
+
     // DIUpdater is in its own scope so that it's destructor, and hence
     // DIBuilder::finalize() gets called. Without that there's dangling stuff.
-    DIUpdater R(M, Filename, Directory);
+    DIUpdater R(M, LineTable, Filename, Directory);
   }
 
   auto DIVersionKey = "Debug Info Version";
   if (!M.getModuleFlag(DIVersionKey))
     // Add the current debug info version into the module.
     M.addModuleFlag(Module::Warning, DIVersionKey, DEBUG_METADATA_VERSION);
-  assert(!verifyModule(M, &errs()) && "verifyModule found issues");
+
+  if (Verify && verifyModule(M, &errs()))
+    return make_error<StringError>("Module verification failed after inserting debug info",
+                                   inconvertibleErrorCode());
+  return Error::success();
 }
 
 }  // namespace llvm
@@ -18,26 +18,36 @@
 #ifndef DEBUG_IR_H
 #define DEBUG_IR_H
 #include <llvm/IR/Module.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/raw_ostream.h>
 
 namespace llvm {
 
 /**
- * Insert debug information into the Module in place. This strips any existing
- * debug information in the module. The debug information simply points back to
- * the generated IR, and _not_ to the cpp code that generated it. The module
- * must also be written to a file in order for the debug information to be
- * useful.
+ * Print the Module to Out and insert debug information into it in place. The
+ * debug information simply points back to the printed IR, and _not_ to the cpp
+ * code that generated it. Out should be the file named by Directory and
+ * Filename, the line numbers are those of the module as printed, which is
+ * before the debug information is inserted. Any existing debug information is
+ * stripped.
+ *
+ * The line numbers are recorded while the module is printed, so it is only
+ * printed once.
  *
  * @note the original pass implementation and the standalone tool based on that
  * pass can clone the module and also handle writing the module to a file. We
- * choose not to do that since we already have a mechanism for writing the
- * module to a file and want to use our own naming convention.
- * @param M The module to create and insert debug info into
+ * choose not to do that since we already have a mechanism for naming the file
+ * the module is written to.
+ * @param M The module to print and to create and insert debug info into
+ * @param Out The stream to print the module to
  * @param Directory The directory containing the llvm-ir file of the module
  * @param Filename The filename of the llvm-ir file of the module within the
  * directory
+ * @param Verify Run the verifier on the module afterwards, returning an error
+ * if it finds issues
  */
-void createDebugInfo(llvm::Module &M, std::string Directory, std::string Filename);
+llvm::Error createDebugInfo(llvm::Module &M, llvm::raw_ostream &Out, std::string Directory,
+                            std::string Filename, bool Verify = false);
 
 }  // namespace llvm
 
@@ -0,0 +1,240 @@
+#include "GuardedCall.hpp"
+
+#include <ucontext.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <llvm/DebugInfo/DWARF/DWARFContext.h>
+#include <llvm/Object/SymbolSize.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/raw_ostream.h>
+
+namespace {
+
+constexpr int GuardedSignals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL};
+
+struct sigaction PreviousActions[NSIG];
+std::once_flag HandlersInstalled;
+
+// plain pointer so the signal handler never triggers thread_local initialization
+thread_local guarded_call_detail::ThreadState *CurrentState = nullptr;
+
+const char *signalName(int Signal) {
+  switch (Signal) {
+    case SIGSEGV:
+      return "SIGSEGV";
+    case SIGBUS:
+      return "SIGBUS";
+    case SIGFPE:
+      return "SIGFPE";
+    case SIGILL:
+      return "SIGILL";
+  }
+  return "signal";
+}
+
+uint64_t faultingPC(void *Context) {
+  auto *UC = static_cast<ucontext_t *>(Context);
+#if defined(__x86_64__)
+  return static_cast<uint64_t>(UC->uc_mcontext.gregs[REG_RIP]);
+#elif defined(__aarch64__)
+  return static_cast<uint64_t>(UC->uc_mcontext.pc);
+#else
+  (void)UC;
+  return 0;
+#endif
+}
+
+void handleFault(int Signal, siginfo_t *Info, void *Context) {
+  guarded_call_detail::ThreadState *State = CurrentState;
+  if (State && State->Active) {
+    State->Active = 0;
+    State->Fault = {Signal, faultingPC(Context), reinterpret_cast<uint64_t>(Info->si_addr)};
+    siglongjmp(State->Env, 1);
+  }
+
+  // Not inside a guarded call, so pass the signal on to whatever handled it before us while
+  // staying installed for later guarded calls.
+  struct sigaction &Previous = PreviousActions[Signal];
+  bool Sent = Info->si_code <= 0;
+  if (Previous.sa_handler != SIG_DFL && Previous.sa_handler != SIG_IGN) {
+    struct sigaction Handler = Previous;
+    // a one-shot handler is replaced by the default action, as it would have been without us
+    if (Handler.sa_flags & SA_RESETHAND) {
+      Previous.sa_handler = SIG_DFL;
+      Previous.sa_flags &= ~(SA_SIGINFO | SA_RESETHAND);
+    }
+    if (Handler.sa_flags & SA_SIGINFO) {
+      Handler.sa_sigaction(Signal, Info, Context);
+    } else {
+      Handler.sa_handler(Signal);
+    }
+    return;
+  }
+  // the kernel does not let a fault be ignored either, it would be re-executed forever
+  if (Previous.sa_handler == SIG_IGN && Sent) return;
+
+  // The default action terminates the process, so there is no guarded call left to handle.
+  // Returning re-executes the faulting instruction, which raises the signal again with the
+  // default action. A signal sent by kill or raise would not be raised again, so resend it.
+  signal(Signal, SIG_DFL);
+  if (Sent) raise(Signal);
+}
+
+void installHandlers() {
+  struct sigaction Action {};
+  Action.sa_sigaction = handleFault;
+  // SA_NODEFER because siglongjmp out of the handler does not restore the signal mask
+  Action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_NODEFER;
+  sigemptyset(&Action.sa_mask);
+  for (int Signal : GuardedSignals) {
+    sigaction(Signal, &Action, &PreviousActions[Signal]);
+  }
+}
+
+/// Owns the alternate signal stack of a thread and its guarded call state.
+class ThreadContext {
+ public:
+  ThreadContext() {
+    std::call_once(HandlersInstalled, installHandlers);
+
+    // keep an alternate stack someone else already installed for this thread
+    stack_t Current;
+    if (sigaltstack(nullptr, &Current) == 0 && (Current.ss_flags & SS_DISABLE)) {
+      const size_t Size = std::max<size_t>(SIGSTKSZ, 64 * 1024);
+      Stack = std::make_unique<char[]>(Size);
+      stack_t AltStack{};
+      AltStack.ss_sp = Stack.get();
+      AltStack.ss_size = Size;
+      if (sigaltstack(&AltStack, nullptr) != 0) Stack.reset();
+    }
+    CurrentState = &State;
+  }
+
+  ~ThreadContext() {
+    CurrentState = nullptr;
+    if (Stack) {
+      stack_t Disable{};
+      Disable.ss_flags = SS_DISABLE;
+      sigaltstack(&Disable, nullptr);
+    }
+  }
+
+  guarded_call_detail::ThreadState State;
+
+ private:
+  std::unique_ptr<char[]> Stack;
+};
+
+}  // anonymous namespace
+
+namespace guarded_call_detail {
+
+ThreadState &threadState() {
+  thread_local ThreadContext Context;
+  return Context.State;
+}
+
+llvm::Error faultError(const FaultSymbolizer &Symbolizer, const FaultInfo &Fault) {
+  std::string Message;
+  llvm::raw_string_ostream OS(Message);
+  OS << signalName(Fault.Signal);
+  if (Fault.Signal == SIGSEGV || Fault.Signal == SIGBUS) {
+    OS << " accessing " << llvm::format_hex(Fault.Address, 0);
+  }
+  OS << " in " << Symbolizer.describe(Fault.PC);
+  return llvm::make_error<llvm::StringError>(OS.str(), llvm::inconvertibleErrorCode());
+}
+
+}  // namespace guarded_call_detail
+
+void FaultSymbolizer::notifyObjectLoaded(ObjectKey K, const llvm::object::ObjectFile &Obj,
+                                         const llvm::RuntimeDyld::LoadedObjectInfo &L) {
+  // the debug object has its sections at their load addresses, which is also what makes the
+  // symbol addresses below load addresses
+  llvm::object::OwningBinary<llvm::object::ObjectFile> DebugObject = L.getObjectForDebug(Obj);
+  if (!DebugObject.getBinary()) return;
+  const llvm::object::ObjectFile &DebugObj = *DebugObject.getBinary();
+
+  std::vector<std::pair<uint64_t, LoadedFunction>> Loaded;
+  for (const auto &[Sym, Size] : llvm::object::computeSymbolSizes(DebugObj)) {
+    auto Type = Sym.getType();
+    if (!Type) {
+      llvm::consumeError(Type.takeError());
+      continue;
+    }
+    if (*Type != llvm::object::SymbolRef::ST_Function) continue;
+    auto Name = Sym.getName();
+    auto Address = Sym.getAddress();
+    auto Section = Sym.getSection();
+    if (!Name || !Address || !Section) {
+      llvm::consumeError(Name.takeError());
+      llvm::consumeError(Address.takeError());
+      llvm::consumeError(Section.takeError());
+      continue;
+    }
+    uint64_t SectionIndex = *Section == DebugObj.section_end()
+                                ? llvm::object::SectionedAddress::UndefSection
+                                : (*Section)->getIndex();
+    Loaded.push_back({*Address, LoadedFunction{Name->str(), Size, SectionIndex, K}});
+  }
+
+  std::unique_ptr<llvm::DIContext> Context;
+  if (KeepDebugObjects) Context = llvm::DWARFContext::create(DebugObj);
+  std::lock_guard<std::mutex> Lock(Mutex);
+  for (auto &[Address, Function] : Loaded) {
+    Functions[Address] = std::move(Function);
+  }
+  if (KeepDebugObjects) Objects[K] = LoadedObject{std::move(DebugObject), std::move(Context)};
+}
+
+void FaultSymbolizer::notifyFreeingObject(ObjectKey K) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  for (auto It = Functions.begin(); It != Functions.end();) {
+    if (It->second.Key == K) {
+      It = Functions.erase(It);
+    } else {
+      ++It;
+    }
+  }
+  Objects.erase(K);
+}
+
+uint64_t FaultSymbolizer::debugObjectBytes() const {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  uint64_t Bytes = 0;
+  for (const auto &[Key, Object] : Objects) {
+    Bytes += Object.DebugObject.getBinary()->getData().size();
+  }
+  return Bytes;
+}
+
+std::string FaultSymbolizer::describe(uint64_t Address) const {
+  std::string Description;
+  llvm::raw_string_ostream OS(Description);
+
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto It = Functions.upper_bound(Address);
+  if (It == Functions.begin() || Address >= std::prev(It)->first + std::prev(It)->second.Size) {
+    OS << "unknown code at " << llvm::format_hex(Address, 0);
+    return OS.str();
+  }
+  --It;
+  const LoadedFunction &Function = It->second;
+
+  llvm::DILineInfo Line;
+  auto Object = Objects.find(Function.Key);
+  if (Object != Objects.end() && Object->second.Context) {
+    Line = Object->second.Context->getLineInfoForAddress(
+        {Address, Function.SectionIndex},
+        llvm::DILineInfoSpecifier(llvm::DILineInfoSpecifier::FileLineInfoKind::RawValue,
+                                  llvm::DILineInfoSpecifier::FunctionNameKind::None));
+  }
+  if (Line.Line != 0) {
+    OS << Function.Name << " at " << Line.FileName << ":" << Line.Line;
+  } else {
+    OS << Function.Name << "+" << llvm::format_hex(Address - It->first, 0);
+  }
+  return OS.str();
+}
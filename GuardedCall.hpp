@@ -0,0 +1,114 @@
+#ifndef GUARDED_CALL_HPP
+#define GUARDED_CALL_HPP
+
+#include <setjmp.h>
+#include <signal.h>
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include <llvm/DebugInfo/DIContext.h>
+#include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/Object/Binary.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Support/Error.h>
+
+/**
+ * Maps addresses in JIT'd code back to the function containing them and, when the function was
+ * compiled with the debug info inserted by `createDebugInfo`, to the line of the generated .ll
+ * file. Register it with the object linking layer to have it track every loaded object.
+ */
+class FaultSymbolizer : public llvm::JITEventListener {
+ public:
+  /// @param KeepDebugObjects keep a copy of each loaded object for its line information. Without
+  /// it, faults are only described by function and offset.
+  explicit FaultSymbolizer(bool KeepDebugObjects = true) : KeepDebugObjects(KeepDebugObjects) {}
+
+  void notifyObjectLoaded(ObjectKey K, const llvm::object::ObjectFile &Obj,
+                          const llvm::RuntimeDyld::LoadedObjectInfo &L) override;
+  void notifyFreeingObject(ObjectKey K) override;
+
+  /// Returns e.g. "buggyAdd at generated_code/my_module.ll:25", "buggyAdd+0x1c" when there is no
+  /// line information, or just the address when it is not in any JIT'd function.
+  std::string describe(uint64_t Address) const;
+
+  /// Returns the size of the object copies kept for line information.
+  uint64_t debugObjectBytes() const;
+
+ private:
+  struct LoadedFunction {
+    std::string Name;
+    uint64_t Size;
+    uint64_t SectionIndex;
+    ObjectKey Key;
+  };
+
+  struct LoadedObject {
+    llvm::object::OwningBinary<llvm::object::ObjectFile> DebugObject;
+    std::unique_ptr<llvm::DIContext> Context;
+  };
+
+  const bool KeepDebugObjects;
+  mutable std::mutex Mutex;
+  // keyed by the load address of each function
+  std::map<uint64_t, LoadedFunction> Functions;
+  std::map<ObjectKey, LoadedObject> Objects;
+};
+
+/// A hardware fault raised by JIT'd code during a `guardedCall`.
+struct FaultInfo {
+  int Signal;
+  uint64_t PC;
+  uint64_t Address;
+};
+
+namespace guarded_call_detail {
+
+struct ThreadState {
+  sigjmp_buf Env;
+  volatile sig_atomic_t Active = 0;
+  FaultInfo Fault;
+};
+
+/// Returns the calling thread's state. The first call on a thread installs an alternate signal
+/// stack for it, and the first call in the process installs the fault handlers.
+ThreadState &threadState();
+
+llvm::Error faultError(const FaultSymbolizer &Symbolizer, const FaultInfo &Fault);
+
+}  // namespace guarded_call_detail
+
+/**
+ * Call Fn with Args, returning an error describing the fault instead of killing the process if
+ * Fn raises SIGSEGV, SIGBUS, SIGFPE or SIGILL. The fault handler runs on a per-thread alternate
+ * signal stack, so a fault caused by a stack overflow can also be recovered from.
+ *
+ * The non-faulting path only adds a sigsetjmp that does not save the signal mask and two stores,
+ * there are no system calls per call. Guarded calls must not be nested on the same thread, and
+ * since Fn is abandoned midway through, it must not hold locks or own resources when it faults.
+ */
+template <typename R, typename... Params, typename... Args>
+auto guardedCall(const FaultSymbolizer &Symbolizer, R (*Fn)(Params...), Args &&...args)
+    -> std::conditional_t<std::is_void_v<R>, llvm::Error, llvm::Expected<R>> {
+  guarded_call_detail::ThreadState &State = guarded_call_detail::threadState();
+  if (sigsetjmp(State.Env, /*savemask=*/0) != 0) {
+    return guarded_call_detail::faultError(Symbolizer, State.Fault);
+  }
+  State.Active = 1;
+  if constexpr (std::is_void_v<R>) {
+    Fn(std::forward<Args>(args)...);
+    State.Active = 0;
+    return llvm::Error::success();
+  } else {
+    R Result = Fn(std::forward<Args>(args)...);
+    State.Active = 0;
+    return Result;
+  }
+}
+
+#endif  // GUARDED_CALL_HPP
@@ -0,0 +1,111 @@
+#ifndef JIT_FUNCTION_HPP
+#define JIT_FUNCTION_HPP
+
+#include <array>
+#include <cassert>
+#include <climits>
+#include <string>
+#include <tuple>
+#include <type_traits>
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/Support/raw_ostream.h>
+
+/**
+ * Maps a C++ type used in the signature of a JIT'd function to the IR type it is passed as.
+ * Only scalars and pointers are supported, aggregates depend on the calling convention.
+ */
+template <typename T, typename Enable = void>
+struct LLVMTypeOf {
+  static_assert(sizeof(T) == 0, "unsupported type in the signature of a JIT'd function");
+};
+
+template <>
+struct LLVMTypeOf<void> {
+  static llvm::Type *get(llvm::LLVMContext &C) { return llvm::Type::getVoidTy(C); }
+};
+
+template <>
+struct LLVMTypeOf<bool> {
+  static llvm::Type *get(llvm::LLVMContext &C) { return llvm::Type::getInt1Ty(C); }
+};
+
+template <typename T>
+struct LLVMTypeOf<T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>>> {
+  static llvm::Type *get(llvm::LLVMContext &C) {
+    return llvm::Type::getIntNTy(C, sizeof(T) * CHAR_BIT);
+  }
+};
+
+template <>
+struct LLVMTypeOf<float> {
+  static llvm::Type *get(llvm::LLVMContext &C) { return llvm::Type::getFloatTy(C); }
+};
+
+template <>
+struct LLVMTypeOf<double> {
+  static llvm::Type *get(llvm::LLVMContext &C) { return llvm::Type::getDoubleTy(C); }
+};
+
+template <typename T>
+struct LLVMTypeOf<T *> {
+  static llvm::Type *get(llvm::LLVMContext &C) { return llvm::PointerType::get(C, 0); }
+};
+
+template <typename Sig>
+class JITFunction;
+
+/**
+ * A JIT'd function with the C++ signature R(Args...), as returned by `MyJIT::getFunction` which
+ * checks the IR-level shape of the signature (arity, widths, int vs fp vs ptr) against the IR
+ * function type. Calling it is a plain indirect call.
+ */
+template <typename R, typename... Args>
+class JITFunction<R(Args...)> {
+ public:
+  using Pointer = R (*)(Args...);
+
+  JITFunction() = default;
+  explicit JITFunction(Pointer Fn) : Fn(Fn) {}
+
+  R operator()(Args... args) const { return Fn(args...); }
+
+  Pointer get() const { return Fn; }
+
+  /// Call the function once per tuple in ArgTuples, storing the i-th result in Results[i].
+  template <typename T = R>
+  void batch(llvm::ArrayRef<std::tuple<Args...>> ArgTuples,
+             llvm::MutableArrayRef<std::enable_if_t<!std::is_void_v<T>, T>> Results) const {
+    assert(ArgTuples.size() == Results.size() && "one result per argument tuple");
+    const Pointer F = Fn;
+    for (size_t I = 0, E = ArgTuples.size(); I < E; I++) {
+      Results[I] = std::apply(F, ArgTuples[I]);
+    }
+  }
+
+  /// Call the function once per tuple in ArgTuples.
+  template <typename T = R, std::enable_if_t<std::is_void_v<T>, int> = 0>
+  void batch(llvm::ArrayRef<std::tuple<Args...>> ArgTuples) const {
+    const Pointer F = Fn;
+    for (size_t I = 0, E = ArgTuples.size(); I < E; I++) {
+      std::apply(F, ArgTuples[I]);
+    }
+  }
+
+  /// Returns the printed IR function type matching R(Args...), e.g. "i32 (ptr, i32)".
+  static std::string getIRSignature(llvm::LLVMContext &C) {
+    std::array<llvm::Type *, sizeof...(Args)> Params{
+        LLVMTypeOf<std::remove_cv_t<Args>>::get(C)...};
+    std::string Signature;
+    llvm::raw_string_ostream OS(Signature);
+    llvm::FunctionType::get(LLVMTypeOf<std::remove_cv_t<R>>::get(C), Params, false)->print(OS);
+    return OS.str();
+  }
+
+ private:
+  Pointer Fn = nullptr;
+};
+
+#endif  // JIT_FUNCTION_HPP
@@ -0,0 +1,211 @@
+#include "PerfCounters.hpp"
+
+#include <llvm/Support/Format.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const char *counterName(PerfCounters::Counter C) {
+  switch (C) {
+    case PerfCounters::Cycles:
+      return "cycles";
+    case PerfCounters::Instructions:
+      return "instructions";
+    case PerfCounters::CacheMisses:
+      return "cache misses";
+    case PerfCounters::BranchMisses:
+      return "branch misses";
+    case PerfCounters::PackedFPInstructions:
+      return "packed fp arithmetic";
+    case PerfCounters::NumCounters:
+      break;
+  }
+  return "unknown";
+}
+
+#ifdef __linux__
+#if defined(__x86_64__)
+/// Returns true if the CPU has the FP_ARITH_INST_RETIRED event at 0xC7. Older Intel cores and the
+/// Atom cores use that event code for other events, so the model is checked against the big cores
+/// from Broadwell on rather than just the vendor.
+bool hasFPArithEvent() {
+  unsigned EAX, EBX, ECX, EDX;
+  if (!__builtin_cpu_is("intel") || !__get_cpuid(1, &EAX, &EBX, &ECX, &EDX)) return false;
+  unsigned Family = (EAX >> 8) & 0xF;
+  if (Family != 6) return false;
+  unsigned Model = ((EAX >> 12) & 0xF0) | ((EAX >> 4) & 0xF);
+  switch (Model) {
+    case 0x3D: case 0x47: case 0x4F: case 0x56:  // Broadwell
+    case 0x4E: case 0x5E: case 0x55:             // Skylake, Skylake-X, Cascade Lake
+    case 0x8E: case 0x9E: case 0xA5: case 0xA6:  // Kaby Lake, Coffee Lake, Comet Lake
+    case 0x66: case 0x7D: case 0x7E: case 0x6A: case 0x6C:  // Cannon Lake, Ice Lake
+    case 0x8C: case 0x8D: case 0xA7:             // Tiger Lake, Rocket Lake
+    case 0x97: case 0x9A: case 0xB7: case 0xBA: case 0xBF:  // Alder Lake, Raptor Lake
+    case 0x8F: case 0xCF:                        // Sapphire Rapids, Emerald Rapids
+      return true;
+    default:
+      return false;
+  }
+}
+#endif
+
+/// Fills in the type and config of Attr for C, returns false if C is not supported on this CPU.
+bool configureCounter(PerfCounters::Counter C, perf_event_attr &Attr) {
+  Attr.type = PERF_TYPE_HARDWARE;
+  switch (C) {
+    case PerfCounters::Cycles:
+      Attr.config = PERF_COUNT_HW_CPU_CYCLES;
+      return true;
+    case PerfCounters::Instructions:
+      Attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+      return true;
+    case PerfCounters::CacheMisses:
+      Attr.config = PERF_COUNT_HW_CACHE_MISSES;
+      return true;
+    case PerfCounters::BranchMisses:
+      Attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+      return true;
+    case PerfCounters::PackedFPInstructions:
+#if defined(__x86_64__)
+      // FP_ARITH_INST_RETIRED with the umask bits of every packed width (128/256/512 bit, single
+      // and double precision)
+      if (hasFPArithEvent()) {
+        Attr.type = PERF_TYPE_RAW;
+        Attr.config = 0xFCC7;
+        return true;
+      }
+#endif
+      return false;
+    case PerfCounters::NumCounters:
+      break;
+  }
+  return false;
+}
+
+int openCounter(PerfCounters::Counter C, int GroupFd) {
+  perf_event_attr Attr{};
+  Attr.size = sizeof(Attr);
+  if (!configureCounter(C, Attr)) return -1;
+  // only the leader starts disabled, the other counters follow the leader
+  Attr.disabled = GroupFd < 0;
+  Attr.exclude_kernel = 1;
+  Attr.exclude_hv = 1;
+  Attr.read_format =
+      PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return static_cast<int>(syscall(SYS_perf_event_open, &Attr, /*pid=*/0, /*cpu=*/-1, GroupFd,
+                                  /*flags=*/0));
+}
+#endif
+
+}  // anonymous namespace
+
+std::optional<double> PerfCounters::Report::ipc() const {
+  if (!Values[Cycles] || !Values[Instructions] || *Values[Cycles] == 0) return std::nullopt;
+  return static_cast<double>(*Values[Instructions]) / *Values[Cycles];
+}
+
+std::optional<double> PerfCounters::Report::bytesPerCycle() const {
+  if (!Values[Cycles] || *Values[Cycles] == 0) return std::nullopt;
+  return static_cast<double>(Bytes) / *Values[Cycles];
+}
+
+PerfCounters::PerfCounters() {
+  Fds.fill(-1);
+#ifdef __linux__
+  for (int C = 0; C < NumCounters; C++) {
+    int Fd = openCounter(static_cast<Counter>(C), LeaderFd);
+    if (Fd < 0) continue;
+    if (LeaderFd < 0) LeaderFd = Fd;
+    Fds[C] = Fd;
+    GroupOrder.push_back(static_cast<Counter>(C));
+  }
+#endif
+}
+
+PerfCounters::~PerfCounters() {
+#ifdef __linux__
+  for (int Fd : Fds) {
+    if (Fd >= 0) close(Fd);
+  }
+#endif
+}
+
+const PerfCounters::Report *PerfCounters::getReport(llvm::StringRef Name) const {
+  auto It = Reports.find(Name);
+  return It == Reports.end() ? nullptr : &It->second;
+}
+
+void PerfCounters::start() {
+#ifdef __linux__
+  if (LeaderFd < 0) return;
+  ioctl(LeaderFd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(LeaderFd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+void PerfCounters::stop(llvm::StringRef Name, uint64_t Bytes,
+                        std::chrono::steady_clock::time_point Begin) {
+  auto End = std::chrono::steady_clock::now();
+  Report &R = Reports[Name];
+  R.Calls++;
+  R.Bytes += Bytes;
+  R.Seconds += std::chrono::duration<double>(End - Begin).count();
+
+#ifdef __linux__
+  if (LeaderFd < 0) return;
+  ioctl(LeaderFd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+  // layout of a group read with PERF_FORMAT_TOTAL_TIME_ENABLED and _RUNNING
+  struct {
+    uint64_t NumValues;
+    uint64_t TimeEnabled;
+    uint64_t TimeRunning;
+    uint64_t Values[NumCounters];
+  } Data;
+  if (read(LeaderFd, &Data, sizeof(Data)) <= 0 || Data.TimeRunning == 0) return;
+
+  // the kernel multiplexes counters when there are more events than hardware counters, scale
+  // the values up to the time the group was enabled for
+  double Scale = static_cast<double>(Data.TimeEnabled) / Data.TimeRunning;
+  for (size_t I = 0; I < GroupOrder.size() && I < Data.NumValues; I++) {
+    std::optional<uint64_t> &Value = R.Values[GroupOrder[I]];
+    Value = Value.value_or(0) + static_cast<uint64_t>(Data.Values[I] * Scale);
+  }
+#endif
+}
+
+void PerfCounters::print(llvm::raw_ostream &OS) const {
+  if (!available()) {
+    OS << "Hardware performance counters are unavailable, reporting wall clock time only.\n";
+  }
+  for (const auto &Entry : Reports) {
+    const Report &R = Entry.getValue();
+    OS << Entry.getKey() << ": " << R.Calls << " calls, "
+       << llvm::format("%.3f", R.Seconds * 1e3) << " ms\n";
+    for (int C = 0; C < NumCounters; C++) {
+      OS << "  " << counterName(static_cast<Counter>(C)) << ": ";
+      if (R.Values[C]) {
+        OS << *R.Values[C] << "\n";
+      } else {
+        OS << "n/a\n";
+      }
+    }
+    if (auto IPC = R.ipc()) OS << "  IPC: " << llvm::format("%.2f", *IPC) << "\n";
+    if (R.Bytes > 0) {
+      if (auto BPC = R.bytesPerCycle()) {
+        OS << "  bytes/cycle: " << llvm::format("%.2f", *BPC) << "\n";
+      } else if (R.Seconds > 0) {
+        OS << "  bytes/ns: " << llvm::format("%.2f", R.Bytes / (R.Seconds * 1e9)) << "\n";
+      }
+    }
+  }
+}
@@ -0,0 +1,93 @@
+#ifndef PERF_COUNTERS_HPP
+#define PERF_COUNTERS_HPP
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/raw_ostream.h>
+
+/**
+ * Measures calls to JIT'd functions with hardware performance counters from perf_event_open,
+ * accumulating the results per function name.
+ *
+ * Each counter is opened independently when the PerfCounters is constructed, and any counter
+ * that cannot be opened (no PMU access inside a container, perf_event_paranoid too high, event not
+ * supported by the CPU) is reported as unavailable. Wall clock time is always measured, so the
+ * report degrades to time and bytes per nanosecond when no counters are available at all.
+ */
+class PerfCounters {
+ public:
+  enum Counter {
+    Cycles,
+    Instructions,
+    CacheMisses,
+    BranchMisses,
+    // packed floating point arithmetic instructions retired, only available on Intel CPUs from
+    // Broadwell on. Integer SIMD, loads, stores and shuffles are not counted, so this is not a
+    // measure of vector unit use and stays 0 for integer kernels.
+    PackedFPInstructions,
+    NumCounters
+  };
+
+  struct Report {
+    uint64_t Calls = 0;
+    uint64_t Bytes = 0;
+    double Seconds = 0;
+    std::array<std::optional<uint64_t>, NumCounters> Values;
+
+    std::optional<double> ipc() const;
+    std::optional<double> bytesPerCycle() const;
+  };
+
+  PerfCounters();
+  ~PerfCounters();
+  PerfCounters(const PerfCounters &) = delete;
+  PerfCounters &operator=(const PerfCounters &) = delete;
+
+  /// Returns true if at least one hardware counter could be opened.
+  bool available() const { return LeaderFd >= 0; }
+
+  /**
+   * Call Fn with Args, recording the counters for the call under Name.
+   * @param Bytes The number of bytes the call reads and writes, used for bytes per cycle
+   */
+  template <typename R, typename... Params, typename... Args>
+  R measure(llvm::StringRef Name, uint64_t Bytes, R (*Fn)(Params...), Args &&...args) {
+    start();
+    auto begin = std::chrono::steady_clock::now();
+    if constexpr (std::is_void_v<R>) {
+      Fn(std::forward<Args>(args)...);
+      stop(Name, Bytes, begin);
+    } else {
+      R result = Fn(std::forward<Args>(args)...);
+      stop(Name, Bytes, begin);
+      return result;
+    }
+  }
+
+  /// Returns the accumulated measurements for Name, or nullptr if it was never measured.
+  const Report *getReport(llvm::StringRef Name) const;
+
+  void print(llvm::raw_ostream &OS) const;
+
+ private:
+  void start();
+  void stop(llvm::StringRef Name, uint64_t Bytes, std::chrono::steady_clock::time_point Begin);
+
+  // all counters are in a single group led by the first counter that could be opened, so that
+  // they are enabled, disabled and scheduled together
+  int LeaderFd = -1;
+  std::array<int, NumCounters> Fds;
+  // counters in the order their values appear when reading the group
+  std::vector<Counter> GroupOrder;
+  llvm::StringMap<Report> Reports;
+};
+
+#endif  // PERF_COUNTERS_HPP
@@ -0,0 +1,226 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/TargetParser/Host.h>
+
+#include "jit.hpp"
+#include "runtime.h"
+
+static llvm::ExitOnError ExitOnErr;
+
+// Creates a module containing `int hashSum(int* arr, int arr_len)` which sums rt_hash_u32 over
+// every element of the array
+llvm::orc::ThreadSafeModule createHashSumModule(const std::string& name,
+                                                const llvm::DataLayout& DL) {
+  auto context = std::make_unique<llvm::LLVMContext>();
+  auto module = std::make_unique<llvm::Module>(name, *context);
+  module->setTargetTriple(llvm::sys::getDefaultTargetTriple());
+  module->setDataLayout(DL);
+  llvm::IRBuilder<> builder(*context);
+
+  llvm::Type* int32Type = llvm::Type::getInt32Ty(*context);
+  llvm::Type* int32PtrType = llvm::PointerType::get(int32Type, 0);
+  llvm::FunctionCallee hashFunc = module->getOrInsertFunction(
+      "rt_hash_u32", llvm::FunctionType::get(int32Type, {int32Type}, false));
+
+  llvm::FunctionType* funcType =
+      llvm::FunctionType::get(int32Type, {int32PtrType, int32Type}, false);
+  llvm::Function* sumFunc =
+      llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, "hashSum", *module);
+  llvm::Argument* arr = sumFunc->getArg(0);
+  llvm::Argument* size = sumFunc->getArg(1);
+  arr->setName("arr");
+  size->setName("arr_len");
+
+  llvm::BasicBlock* entryBB = llvm::BasicBlock::Create(*context, "entry", sumFunc);
+  llvm::BasicBlock* loopBB = llvm::BasicBlock::Create(*context, "loop", sumFunc);
+  llvm::BasicBlock* exitBB = llvm::BasicBlock::Create(*context, "exit", sumFunc);
+
+  builder.SetInsertPoint(entryBB);
+  llvm::Value* zero = llvm::ConstantInt::get(int32Type, 0);
+  builder.CreateCondBr(builder.CreateICmpSGT(size, zero), loopBB, exitBB);
+
+  builder.SetInsertPoint(loopBB);
+  llvm::PHINode* index = builder.CreatePHI(int32Type, 2, "index");
+  llvm::PHINode* sum = builder.CreatePHI(int32Type, 2, "sum");
+  llvm::Value* value = builder.CreateLoad(int32Type, builder.CreateGEP(int32Type, arr, index));
+  llvm::Value* newSum = builder.CreateAdd(sum, builder.CreateCall(hashFunc, {value}), "newSum");
+  llvm::Value* nextIndex = builder.CreateAdd(index, llvm::ConstantInt::get(int32Type, 1));
+  index->addIncoming(zero, entryBB);
+  index->addIncoming(nextIndex, loopBB);
+  sum->addIncoming(zero, entryBB);
+  sum->addIncoming(newSum, loopBB);
+  builder.CreateCondBr(builder.CreateICmpSLT(nextIndex, size), loopBB, exitBB);
+
+  builder.SetInsertPoint(exitBB);
+  llvm::PHINode* result = builder.CreatePHI(int32Type, 2, "result");
+  result->addIncoming(zero, entryBB);
+  result->addIncoming(newSum, loopBB);
+  builder.CreateRet(result);
+
+  return llvm::orc::ThreadSafeModule(std::move(module), std::move(context));
+}
+
+// Creates a module containing `int tableSum(int* arr, int arr_len)` which sums table[arr[i]]
+// over the array for a 1024 element global table, so that bounds checking has an object of known
+// size to check accesses against. The index is loaded from memory and not masked, so the optimizer
+// cannot prove it is in bounds and the check stays in the loop; callers keep it below 1024. The
+// loads from `arr` itself go through a pointer argument of unknown size, which bounds checking
+// does not check.
+llvm::orc::ThreadSafeModule createTableSumModule(const std::string& name,
+                                                 const llvm::DataLayout& DL) {
+  auto context = std::make_unique<llvm::LLVMContext>();
+  auto module = std::make_unique<llvm::Module>(name, *context);
+  module->setTargetTriple(llvm::sys::getDefaultTargetTriple());
+  module->setDataLayout(DL);
+  llvm::IRBuilder<> builder(*context);
+
+  llvm::Type* int32Type = llvm::Type::getInt32Ty(*context);
+  llvm::Type* int32PtrType = llvm::PointerType::get(int32Type, 0);
+  constexpr unsigned table_size = 1024;
+  std::vector<uint32_t> table_values(table_size);
+  for (unsigned i = 0; i < table_size; i++) {
+    table_values[i] = i * 7;
+  }
+  llvm::Constant* tableInit =
+      llvm::ConstantDataArray::get(*context, llvm::ArrayRef<uint32_t>(table_values));
+  auto* table = new llvm::GlobalVariable(*module, tableInit->getType(), /*isConstant=*/false,
+                                         llvm::GlobalValue::InternalLinkage, tableInit, "table");
+
+  llvm::FunctionType* funcType =
+      llvm::FunctionType::get(int32Type, {int32PtrType, int32Type}, false);
+  llvm::Function* sumFunc =
+      llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, "tableSum", *module);
+  llvm::Argument* arr = sumFunc->getArg(0);
+  llvm::Argument* size = sumFunc->getArg(1);
+  arr->setName("arr");
+  size->setName("arr_len");
+
+  llvm::BasicBlock* entryBB = llvm::BasicBlock::Create(*context, "entry", sumFunc);
+  llvm::BasicBlock* loopBB = llvm::BasicBlock::Create(*context, "loop", sumFunc);
+  llvm::BasicBlock* exitBB = llvm::BasicBlock::Create(*context, "exit", sumFunc);
+
+  builder.SetInsertPoint(entryBB);
+  llvm::Value* zero = llvm::ConstantInt::get(int32Type, 0);
+  builder.CreateCondBr(builder.CreateICmpSGT(size, zero), loopBB, exitBB);
+
+  builder.SetInsertPoint(loopBB);
+  llvm::PHINode* index = builder.CreatePHI(int32Type, 2, "index");
+  llvm::PHINode* sum = builder.CreatePHI(int32Type, 2, "sum");
+  llvm::Value* slot =
+      builder.CreateLoad(int32Type, builder.CreateGEP(int32Type, arr, index), "slot");
+  llvm::Value* entry = builder.CreateLoad(
+      int32Type, builder.CreateGEP(tableInit->getType(), table, {zero, slot}), "entry");
+  llvm::Value* newSum = builder.CreateAdd(sum, entry, "newSum");
+  llvm::Value* nextIndex = builder.CreateAdd(index, llvm::ConstantInt::get(int32Type, 1));
+  index->addIncoming(zero, entryBB);
+  index->addIncoming(nextIndex, loopBB);
+  sum->addIncoming(zero, entryBB);
+  sum->addIncoming(newSum, loopBB);
+  builder.CreateCondBr(builder.CreateICmpSLT(nextIndex, size), loopBB, exitBB);
+
+  builder.SetInsertPoint(exitBB);
+  llvm::PHINode* result = builder.CreatePHI(int32Type, 2, "result");
+  result->addIncoming(zero, entryBB);
+  result->addIncoming(newSum, loopBB);
+  builder.CreateRet(result);
+
+  return llvm::orc::ThreadSafeModule(std::move(module), std::move(context));
+}
+
+// Returns the fastest of `runs` calls in nanoseconds per element
+template <typename F>
+double timeNsPerElement(F&& f, int arr_size, int runs = 50) {
+  double best = std::numeric_limits<double>::max();
+  for (int i = 0; i < runs; i++) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto end = std::chrono::steady_clock::now();
+    best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count());
+  }
+  return best / arr_size;
+}
+
+// Calls to rt_hash_u32 from hashSum either go through the host process, or are inlined after
+// the runtime library is linked into the module.
+void benchmarkRuntimeInlining(const std::vector<int>& arr) {
+  MyJIT callJIT;
+  ExitOnErr(callJIT.addHostSymbol("rt_hash_u32", reinterpret_cast<const void*>(&rt_hash_u32)));
+  ExitOnErr(callJIT.addModule(createHashSumModule("bench_call", callJIT.getDataLayout())));
+  auto call_fp = ExitOnErr(callJIT.getFunction<int(const int*, int)>("hashSum"));
+
+  MyJIT inlineJIT;
+  ExitOnErr(inlineJIT.setRuntimeLibrary("runtime.bc"));
+  ExitOnErr(inlineJIT.addModule(createHashSumModule("bench_inlined", inlineJIT.getDataLayout())));
+  auto inline_fp = ExitOnErr(inlineJIT.getFunction<int(const int*, int)>("hashSum"));
+
+  uint32_t expected = 0;
+  for (int value : arr) {
+    expected += rt_hash_u32(static_cast<uint32_t>(value));
+  }
+  const int arr_size = static_cast<int>(arr.size());
+  if (static_cast<uint32_t>(call_fp(arr.data(), arr_size)) != expected ||
+      static_cast<uint32_t>(inline_fp(arr.data(), arr_size)) != expected) {
+    std::cout << "hashSum returned the wrong result" << std::endl;
+    return;
+  }
+
+  volatile int sink;
+  double call_ns = timeNsPerElement([&] { sink = call_fp(arr.data(), arr_size); }, arr_size);
+  double inline_ns = timeNsPerElement([&] { sink = inline_fp(arr.data(), arr_size); }, arr_size);
+  std::cout << "hashSum calling rt_hash_u32:  " << call_ns << " ns/element" << std::endl;
+  std::cout << "hashSum inlining rt_hash_u32: " << inline_ns << " ns/element ("
+            << call_ns / inline_ns << "x)" << std::endl;
+}
+
+// Slowdown of tableSum for each instrumentation mode relative to uninstrumented code. The
+// AddressSanitizer mode is skipped unless the benchmark was built with `make ASAN=1`.
+void benchmarkInstrumentation(const std::vector<int>& values) {
+  const std::pair<InstrumentationMode, const char*> modes[] = {
+      {InstrumentationMode::None, "none"},
+      {InstrumentationMode::BoundsChecking, "bounds_checking"},
+      {InstrumentationMode::AddressSanitizer, "address_sanitizer"}};
+  // tableSum does not bound its indices itself, see `createTableSumModule`
+  std::vector<int> arr(values.size());
+  for (size_t i = 0; i < values.size(); i++) {
+    arr[i] = values[i] % 1024;
+  }
+  const int arr_size = static_cast<int>(arr.size());
+  double baseline_ns = 0;
+  for (const auto& [mode, name] : modes) {
+    MyJIT jit(mode);
+    if (jit.getInstrumentationMode() != mode) continue;
+    ExitOnErr(jit.addModule(
+        createTableSumModule(std::string("bench_table_") + name, jit.getDataLayout())));
+    auto table_sum_fp = ExitOnErr(jit.getFunction<int(const int*, int)>("tableSum"));
+
+    volatile int sink;
+    double ns = timeNsPerElement([&] { sink = table_sum_fp(arr.data(), arr_size); }, arr_size);
+    if (mode == InstrumentationMode::None) baseline_ns = ns;
+    std::cout << "tableSum with " << name << " instrumentation: " << ns << " ns/element ("
+              << ns / baseline_ns << "x slowdown)" << std::endl;
+  }
+}
+
+int main() {
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+  llvm::InitializeNativeTargetAsmParser();
+
+  constexpr int MiB = 1024 * 1024;
+  std::vector<int> arr(MiB);
+  for (int i = 0; i < MiB; i++) {
+    arr[i] = i;
+  }
+
+  benchmarkRuntimeInlining(arr);
+  benchmarkInstrumentation(arr);
+  return 0;
+}
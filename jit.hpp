@@ -7,10 +7,13 @@
 #include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
 #include <llvm/ExecutionEngine/Orc/ExecutorProcessControl.h>
 #include <llvm/ExecutionEngine/Orc/IRCompileLayer.h>
+#include <llvm/ExecutionEngine/Orc/IndirectionUtils.h>
 #include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
 #include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
+#include <llvm/ExecutionEngine/Orc/TaskDispatch.h>
 #include <llvm/ExecutionEngine/Orc/Shared/ExecutorSymbolDef.h>
 #include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/IR/Constants.h>
 #include <llvm/IR/DataLayout.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/ExecutionEngine/JITEventListener.h>
@@ -20,14 +23,134 @@
 #include <llvm/ExecutionEngine/Orc/ObjectTransformLayer.h>
 #include <llvm/ExecutionEngine/Orc/DebugUtils.h>
 #include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Transforms/IPO/Internalize.h>
+#include <llvm/Transforms/Instrumentation/AddressSanitizer.h>
+#include <llvm/Transforms/Instrumentation/BoundsChecking.h>
+#include <llvm/Support/DynamicLibrary.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Object/Archive.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Object/ArchiveWriter.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Process.h>
+#include <llvm/IR/DebugInfo.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include "BatchEntryPoints.hpp"
 #include "DebugIR.hpp"
+#include "GuardedCall.hpp"
+#include "JITFunction.hpp"
+
+// compiler runtime builtins from libgcc or compiler-rt, see `MyJIT::addBuiltinHostSymbols`
+extern "C" {
+#ifdef __SIZEOF_INT128__
+__int128 __divti3(__int128, __int128);
+unsigned __int128 __udivti3(unsigned __int128, unsigned __int128);
+__int128 __modti3(__int128, __int128);
+unsigned __int128 __umodti3(unsigned __int128, unsigned __int128);
+__int128 __fixdfti(double);
+unsigned __int128 __fixunsdfti(double);
+double __floattidf(__int128);
+double __floatuntidf(unsigned __int128);
+#endif
+double __powidf2(double, int);
+float __powisf2(float, int);
+}
+
+/**
+ * Checks inserted into generated code to catch out of bounds memory accesses.
+ *  - BoundsChecking: LLVM's bounds checking pass, which traps on accesses outside of objects
+ *    whose size is known (allocas, globals). The checks are inserted before optimization so that
+ *    redundant ones are removed. Accesses through pointers whose object is unknown, like pointer
+ *    arguments or the wild pointer `createBuggyAddFunction` in main.cpp loads from, are not
+ *    checked, so such faults are still left to `guardedCall`.
+ *  - AddressSanitizer: ASan shadow memory checks on every load and store, inserted after
+ *    optimization like clang does. The host must be built with AddressSanitizer (`make ASAN=1`)
+ *    since JIT'd code uses its runtime.
+ */
+enum class InstrumentationMode { None, BoundsChecking, AddressSanitizer };
+
+/**
+ * How a MyJIT compiles code and what it keeps around for debugging it. The defaults print the IR
+ * and objects to generated_code/ with debug info pointing at the printed IR; turn those off and
+ * turn on `LeanMemory` to use as little memory as possible.
+ */
+struct JITOptions {
+  InstrumentationMode Instrumentation = InstrumentationMode::None;
+  // insert debug info pointing at the printed IR before optimization, or after it
+  bool InsertPreoptDebugInfo = true;
+  bool InsertPostoptDebugInfo = false;
+  // run the verifier on every module debug info was inserted into, which is as slow as inserting
+  // it
+  bool VerifyDebugInfo = false;
+  bool PrintGeneratedCode = true;
+  bool DumpCompiledObjectFiles = true;
+  // Compile every module as soon as it is added instead of on the first lookup of one of its
+  // symbols, so its IR, and its context if no other module uses it, is freed right after its
+  // object is emitted. Without debug info, names and debug metadata are also stripped before
+  // codegen and instructions are not given names, and faults are described without the line
+  // information that needs a copy of every object. Since compiling a module resolves its
+  // references, a module must be added after the modules it uses, or together with them by
+  // `addBitcodeDirectory` or `commitBatch`; otherwise adding it fails.
+  bool LeanMemory = false;
+};
+
+/**
+ * Runs ORC's materialization tasks on a fixed size thread pool, one thread per hardware thread,
+ * so that adding thousands of modules at once does not start a compiler thread for each of them
+ * like `DynamicThreadPoolTaskDispatcher` does.
+ */
+class ThreadPoolTaskDispatcher : public llvm::orc::TaskDispatcher {
+ public:
+  void dispatch(std::unique_ptr<llvm::orc::Task> T) override {
+    // the pool only takes copyable callables
+    std::shared_ptr<llvm::orc::Task> Shared(std::move(T));
+    Pool.async([Shared]() { Shared->run(); });
+  }
+
+  void shutdown() override { Pool.wait(); }
+
+ private:
+  llvm::ThreadPool Pool;
+};
 
 class MyJIT {
  private:
-  const bool insert_preopt_debug_info = true;
-  const bool insert_postopt_debug_info = false;
-  const bool print_generated_code = true;
-  const bool dump_compiled_object_files = true;
+  // see `JITOptions`
+  const bool insert_preopt_debug_info;
+  const bool insert_postopt_debug_info;
+  const bool verify_debug_info;
+  const bool print_generated_code;
+  const bool dump_compiled_object_files;
+  // keep a copy of every emitted object file so that `saveSnapshot` can write them out, see
+  // `enableSnapshotRecording`
+  bool record_snapshot_objects = false;
+  const InstrumentationMode instrumentation_mode;
+  const bool lean_memory;
+  const bool strip_ir_before_codegen =
+      lean_memory && !insert_preopt_debug_info && !insert_postopt_debug_info;
+  // host functions generated code may call, resolved once at startup. Any other host symbol has
+  // to be added explicitly with `addHostSymbol` or `addHostSymbols`.
+  static constexpr const char *default_host_symbols[] = {
+      "memcpy", "memmove", "memset", "memcmp", "malloc", "free",   "abort",  "sqrt",
+      "sqrtf",  "exp",     "expf",   "exp2",   "exp2f",  "log",    "logf",   "log2",
+      "log2f",  "log10",   "log10f", "pow",    "powf",   "fmod",   "fmodf",  "sin",
+      "sinf",   "cos",     "cosf",   "tan",    "tanf",   "fabs",   "fabsf",  "fma",
+      "fmaf",   "fmin",    "fminf",  "fmax",   "fmaxf",  "floor",  "floorf", "ceil",
+      "ceilf",  "round",   "roundf", "trunc",  "truncf", "rint",   "rintf",  "nearbyint",
+      "nearbyintf"};
   llvm::orc::ExecutionSession ES;
   llvm::orc::JITTargetMachineBuilder JTMB;
   llvm::DataLayout DL;
@@ -42,10 +165,60 @@ class MyJIT {
   llvm::orc::JITDylib &MainJD;
   llvm::JITEventListener *PerfListener;
   llvm::JITEventListener *GDBListener;
+  FaultSymbolizer Symbolizer;
+  // symbol name -> printed IR function type of everything exported from MainJD
+  llvm::StringMap<std::string> ExportedSignatures;
+  // every symbol defined by a module added to MainJD, including hidden ones and variables, which
+  // `saveSnapshot` looks up to get all of them compiled
+  llvm::StringSet<> DefinedSymbols;
+  // context for building the IR types of C++ signatures passed to `getFunction`
+  std::mutex SignatureMutex;
+  llvm::LLVMContext SignatureContext;
+  mutable std::mutex SnapshotMutex;
+  std::vector<std::unique_ptr<llvm::MemoryBuffer>> SnapshotObjects;
+  // object files added by `loadSnapshot`, which point into SnapshotBuffers
+  std::vector<llvm::MemoryBufferRef> LoadedSnapshotObjects;
+  // mapped snapshot archives, and copies of any of their members that were not aligned
+  std::vector<std::unique_ptr<llvm::MemoryBuffer>> SnapshotBuffers;
+  // bitcode of the runtime support library linked into each module before optimization
+  std::unique_ptr<llvm::MemoryBuffer> RuntimeLibrary;
+  // scalar functions to create a `<name>_batch` entry point for, see `requestBatchEntryPoint`
+  llvm::StringSet<> BatchEntryPoints;
+  // while batching, modules passed to addModule are held back until `commitBatch`
+  bool batching = false;
+  std::vector<llvm::orc::ThreadSafeModule> PendingModules;
+  unsigned batch_count = 0;
+  // gives the local symbols of lazily loaded bitcode external names so that its functions can be
+  // compiled in separate partitions, shared so that the names are unique across modules
+  llvm::orc::SymbolLinkagePromoter PromoteLocals;
+  std::atomic<unsigned> partition_count = 0;
+  // memory used by each loaded module, keyed by module name, see `printMemoryReport`
+  struct ModuleMemory {
+    // size of the emitted object file
+    uint64_t ObjectBytes = 0;
+    // code and data sections loaded into memory for the module
+    uint64_t LoadedBytes = 0;
+  };
+  mutable std::mutex MemoryMutex;
+  llvm::StringMap<ModuleMemory> MemoryReport;
+  // the process RSS is only reported as a whole, since modules are materialized concurrently
+  const uint64_t resident_at_creation = residentBytes();
 
  public:
-  MyJIT()
-      : ES{llvm::cantFail(llvm::orc::SelfExecutorProcessControl::Create())},
+  explicit MyJIT(InstrumentationMode Mode) : MyJIT(JITOptions{Mode}) {}
+
+  explicit MyJIT(const JITOptions &Options = JITOptions())
+      : insert_preopt_debug_info(Options.InsertPreoptDebugInfo),
+        insert_postopt_debug_info(Options.InsertPostoptDebugInfo),
+        verify_debug_info(Options.VerifyDebugInfo),
+        print_generated_code(Options.PrintGeneratedCode),
+        dump_compiled_object_files(Options.DumpCompiledObjectFiles),
+        instrumentation_mode(checkInstrumentationMode(Options.Instrumentation)),
+        lean_memory(Options.LeanMemory),
+        // materialize modules on a thread pool so that independent modules are printed, have debug
+        // info inserted, are optimized and compiled in parallel
+        ES{llvm::cantFail(llvm::orc::SelfExecutorProcessControl::Create(
+            nullptr, std::make_unique<ThreadPoolTaskDispatcher>()))},
         JTMB(llvm::cantFail(llvm::orc::JITTargetMachineBuilder::detectHost())
                  .setCodeGenOptLevel(llvm::CodeGenOpt::Aggressive)
                  .setCodeModel(llvm::CodeModel::Model::Large)),
@@ -54,10 +227,14 @@ class MyJIT {
         LinkingLayer(ES, []() { return std::make_unique<llvm::SectionMemoryManager>(); }),
         DumpObjectTransform{llvm::orc::DumpObjects("generated_code/")},
         DumpObjectTransformLayer(ES, LinkingLayer,
-                                 [&transform = this->DumpObjectTransform,
+                                 [this, &transform = this->DumpObjectTransform,
                                   dump_compiled_object_files = this->dump_compiled_object_files](
                                      std::unique_ptr<llvm::MemoryBuffer> buf)
                                      -> llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> {
+                                   if (record_snapshot_objects) {
+                                     recordSnapshotObject(*buf);
+                                   }
+                                   recordObjectSize(*buf);
                                    if (dump_compiled_object_files) {
                                      return transform(std::move(buf));
                                    } else {
@@ -69,37 +246,61 @@ class MyJIT {
         PrintOptimizedIRLayer(
             ES, CompileLayer,
             [print_generated_code = this->print_generated_code,
-             insert_debug_info = this->insert_postopt_debug_info](
+             insert_debug_info = this->insert_postopt_debug_info,
+             verify = this->verify_debug_info,
+             strip = this->strip_ir_before_codegen](
                 llvm::orc::ThreadSafeModule TSM, const llvm::orc::MaterializationResponsibility &R)
                 -> llvm::Expected<llvm::orc::ThreadSafeModule> {
               if (print_generated_code) {
-                return printIR(std::move(TSM), "_opt", insert_debug_info);
+                auto Printed = printIR(std::move(TSM), "_opt", insert_debug_info, verify);
+                if (!Printed) return Printed.takeError();
+                TSM = std::move(*Printed);
               }
+              if (strip) TSM.withModuleDo([](llvm::Module &M) { stripNamesAndDebugInfo(M); });
               return std::move(TSM);
             }),
         TransformLayer(ES, PrintOptimizedIRLayer,
-                       [TM = JTMB.createTargetMachine()](
-                           llvm::orc::ThreadSafeModule TSM,
-                           const llvm::orc::MaterializationResponsibility &R) mutable
-                       -> llvm::Expected<llvm::orc::ThreadSafeModule> {
+                       [this](llvm::orc::ThreadSafeModule TSM,
+                              const llvm::orc::MaterializationResponsibility &R)
+                           -> llvm::Expected<llvm::orc::ThreadSafeModule> {
+                         // one per module since modules are optimized concurrently
+                         auto TM = JTMB.createTargetMachine();
                          if (!TM) return TM.takeError();
-                         return optimizeModule(std::move(TSM), std::move(TM.get()));
+                         std::vector<std::string> RuntimeNames;
+                         if (RuntimeLibrary) {
+                           if (auto Err = TSM.withModuleDo([this, &RuntimeNames](llvm::Module &M) {
+                                 return linkRuntimeLibrary(M, RuntimeLibrary->getMemBufferRef(),
+                                                           RuntimeNames);
+                               })) {
+                             return std::move(Err);
+                           }
+                         }
+                         auto Optimized = optimizeModule(std::move(TSM), std::move(TM.get()),
+                                                         instrumentation_mode);
+                         if (!Optimized) return Optimized.takeError();
+                         Optimized->withModuleDo([&RuntimeNames](llvm::Module &M) {
+                           stripUnusedRuntimeGlobals(M, RuntimeNames);
+                         });
+                         return Optimized;
                        }),
         PrintGeneratedIRLayer(
             ES, TransformLayer,
-            [print_generated_code = this->print_generated_code,
-             insert_debug_info = this->insert_preopt_debug_info](
+            [this, print_generated_code = this->print_generated_code,
+             insert_debug_info = this->insert_preopt_debug_info,
+             verify = this->verify_debug_info](
                 llvm::orc::ThreadSafeModule TSM, const llvm::orc::MaterializationResponsibility &R)
                 -> llvm::Expected<llvm::orc::ThreadSafeModule> {
-              TSM = nameInstructions(std::move(TSM));
+              if (auto Err = materializeLazyModule(TSM)) return std::move(Err);
+              if (!strip_ir_before_codegen) TSM = nameInstructions(std::move(TSM));
               if (print_generated_code) {
-                return printIR(std::move(TSM), "", insert_debug_info);
+                return printIR(std::move(TSM), "", insert_debug_info, verify);
               }
               return std::move(TSM);
             }),
         MainJD(ES.createBareJITDylib("<main>")),
         PerfListener(llvm::JITEventListener::createPerfJITEventListener()),
-        GDBListener(llvm::JITEventListener::createGDBRegistrationListener()) {
+        GDBListener(llvm::JITEventListener::createGDBRegistrationListener()),
+        Symbolizer(/*KeepDebugObjects=*/!lean_memory) {
     if (PerfListener == nullptr) {
       std::cout << "Could not create Perf listener. Perhaps LLVM was not "
                    "compiled with perf support (LLVM_USE_PERF)."
@@ -114,8 +315,28 @@ class MyJIT {
       LinkingLayer.registerJITEventListener(*GDBListener);
     }
 
-    MainJD.addGenerator(llvm::cantFail(
-        llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(DL.getGlobalPrefix())));
+    LinkingLayer.registerJITEventListener(Symbolizer);
+    LinkingLayer.setNotifyLoaded([this](llvm::orc::MaterializationResponsibility &R,
+                                        const llvm::object::ObjectFile &Obj,
+                                        const llvm::RuntimeDyld::LoadedObjectInfo &) {
+      recordObjectLoaded(Obj);
+    });
+
+    // generated code can only bind to host symbols in the registry, rather than to anything in
+    // the process through a dlsym for every unresolved symbol
+    std::vector<llvm::StringRef> HostSymbols(std::begin(default_host_symbols),
+                                             std::end(default_host_symbols));
+    llvm::cantFail(addHostSymbols(HostSymbols, /*IgnoreMissing=*/true));
+    llvm::cantFail(addBuiltinHostSymbols());
+
+    if (instrumentation_mode == InstrumentationMode::AddressSanitizer) {
+      // there are too many ASan runtime entry points to list, so allow binding to any of them
+      MainJD.addGenerator(
+          llvm::cantFail(llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+              DL.getGlobalPrefix(), [](const llvm::orc::SymbolStringPtr &Name) {
+                return (*Name).startswith("__asan_");
+              })));
+    }
   }
 
   ~MyJIT() {
@@ -124,6 +345,8 @@ class MyJIT {
 
   const llvm::DataLayout &getDataLayout() const { return DL; }
 
+  InstrumentationMode getInstrumentationMode() const { return instrumentation_mode; }
+
   llvm::Error addModule(llvm::orc::ThreadSafeModule TSM) {
     bool verification_failed = TSM.withModuleDo(
         [](llvm::Module &M) -> bool { return llvm::verifyModule(M, &llvm::errs()); });
@@ -131,18 +354,503 @@ class MyJIT {
       return llvm::make_error<llvm::StringError>("Module verification failed",
                                                  llvm::inconvertibleErrorCode());
     }
+    return addModuleWithoutVerification(std::move(TSM));
+  }
+
+  /**
+   * Create a `<ScalarName>_batch` entry point, see `createBatchEntryPoint`, in every module added
+   * after this call that defines the scalar function `ScalarName`.
+   */
+  void requestBatchEntryPoint(llvm::StringRef ScalarName) { BatchEntryPoints.insert(ScalarName); }
 
-    return PrintGeneratedIRLayer.add(MainJD, std::move(TSM));
+  /**
+   * Start collecting the modules passed to `addModule`, `addIRFile`, `addBitcodeFile` and
+   * `addBitcodeDirectory` instead of adding them to the JIT, so they can be optimized together by
+   * `commitBatch`.
+   */
+  void beginBatch() { batching = true; }
+
+  /**
+   * Link every module collected since `beginBatch` into a single module, internalize everything
+   * except `Exports` and add the result to the JIT. Each module is first run through the LTO
+   * pre-link pipeline at `Level`, and the combined module is optimized with the LTO pipeline at
+   * `Level` instead of the per-module pipeline, so calls between the batched modules can be
+   * inlined and constants propagated across them. `Level` must be O2 or O3.
+   *
+   * If the modules cannot be combined, e.g. because an export is not defined by any of them, the
+   * error is returned and the batch is left as it was, so it can be committed again.
+   */
+  llvm::Error commitBatch(llvm::ArrayRef<std::string> Exports,
+                          llvm::OptimizationLevel Level = llvm::OptimizationLevel::O2) {
+    if (Level != llvm::OptimizationLevel::O2 && Level != llvm::OptimizationLevel::O3) {
+      return llvm::make_error<llvm::StringError>("Batches can only be optimized at O2 or O3",
+                                                 llvm::inconvertibleErrorCode());
+    }
+    if (PendingModules.empty()) {
+      batching = false;
+      return llvm::Error::success();
+    }
+
+    auto TM = JTMB.createTargetMachine();
+    if (!TM) return TM.takeError();
+    auto Ctx = std::make_unique<llvm::LLVMContext>();
+    auto Combined = std::make_unique<llvm::Module>("lto_batch_" + std::to_string(batch_count++),
+                                                   *Ctx);
+    Combined->setDataLayout(DL);
+    llvm::Linker L(*Combined);
+    for (auto &TSM : PendingModules) {
+      // modules from `addBitcodeFile` still have their function bodies in the bitcode
+      if (auto Err = materializeLazyModule(TSM)) return Err;
+      // every module has its own context, so move it into the combined context through bitcode
+      llvm::SmallVector<char, 0> Bitcode;
+      TSM.withModuleDo([&Bitcode, &TM, Level](llvm::Module &M) {
+        optimizeForLTOPreLink(M, **TM, Level);
+        llvm::raw_svector_ostream OS(Bitcode);
+        llvm::WriteBitcodeToFile(M, OS);
+      });
+      auto M = llvm::parseBitcodeFile(
+          llvm::MemoryBufferRef(llvm::StringRef(Bitcode.data(), Bitcode.size()), "lto_batch"),
+          *Ctx);
+      if (!M) return M.takeError();
+      if (L.linkInModule(std::move(*M))) {
+        return llvm::make_error<llvm::StringError>("Linking batched modules failed",
+                                                   llvm::inconvertibleErrorCode());
+      }
+    }
+
+    llvm::StringSet<> ExportSet;
+    for (const std::string &Name : Exports) {
+      llvm::GlobalValue *GV = Combined->getNamedValue(Name);
+      if (!GV || GV->isDeclaration()) {
+        return llvm::make_error<llvm::StringError>(
+            "Export " + Name + " is not defined by any batched module",
+            llvm::inconvertibleErrorCode());
+      }
+      ExportSet.insert(Name);
+    }
+    llvm::internalizeModule(*Combined, [&ExportSet](const llvm::GlobalValue &GV) {
+      return ExportSet.count(GV.getName()) != 0;
+    });
+    Combined->addModuleFlag(llvm::Module::Warning, "jit-lto-level", Level.getSpeedupLevel());
+
+    // only now that the batch has been combined are its modules let go of
+    batching = false;
+    PendingModules.clear();
+    return addModuleWithoutVerification(
+        llvm::orc::ThreadSafeModule(std::move(Combined), std::move(Ctx)));
+  }
+
+  /**
+   * Link the bitcode runtime library at `Path` into every module before it is optimized, so
+   * that small runtime helpers can be inlined into generated code instead of being opaque calls
+   * into the host process. Must be called before any modules are added.
+   */
+  llvm::Error setRuntimeLibrary(llvm::StringRef Path) {
+    auto Buffer = llvm::MemoryBuffer::getFile(Path, /*IsText=*/false,
+                                              /*RequiresNullTerminator=*/false);
+    if (!Buffer) return llvm::createFileError(Path, Buffer.getError());
+    RuntimeLibrary = std::move(*Buffer);
+    return llvm::Error::success();
+  }
+
+  /**
+   * Parse a textual (.ll) or bitcode (.bc) IR file up front and add it to the JIT.
+   */
+  llvm::Error addIRFile(llvm::StringRef Path) {
+    auto Ctx = std::make_unique<llvm::LLVMContext>();
+    llvm::SMDiagnostic Diag;
+    std::unique_ptr<llvm::Module> M = llvm::parseIRFile(Path, Diag, *Ctx);
+    if (!M) return diagnosticError(Diag);
+    if (auto Err = checkTarget(*M)) return Err;
+    return addModule(llvm::orc::ThreadSafeModule(std::move(M), std::move(Ctx)));
+  }
+
+  /**
+   * Add a bitcode file to the JIT without parsing its function bodies. The file is memory mapped
+   * and a function body is only read from it, and compiled, when the function is looked up or is
+   * called by a function that is being compiled; the rest of the module stays in the file.
+   * Verification is deferred until then as well, and is done per compiled partition.
+   */
+  llvm::Error addBitcodeFile(llvm::StringRef Path) {
+    auto TSM = loadBitcodeFile(Path);
+    if (!TSM) return TSM.takeError();
+    return addModuleWithoutVerification(std::move(*TSM));
+  }
+
+  /**
+   * Lazily load every .bc file in `Directory` in parallel, see `addBitcodeFile`.
+   */
+  llvm::Error addBitcodeDirectory(llvm::StringRef Directory) {
+    std::vector<std::string> Paths;
+    std::error_code EC;
+    for (llvm::sys::fs::directory_iterator It(Directory, EC), End; It != End && !EC;
+         It.increment(EC)) {
+      if (llvm::sys::path::extension(It->path()) == ".bc") Paths.push_back(It->path());
+    }
+    if (EC) return llvm::errorCodeToError(EC);
+    // add modules in a deterministic order regardless of directory iteration order
+    std::sort(Paths.begin(), Paths.end());
+
+    std::vector<llvm::orc::ThreadSafeModule> Modules(Paths.size());
+    std::vector<std::string> Errors(Paths.size());
+    {
+      llvm::ThreadPool Pool;
+      for (size_t I = 0; I < Paths.size(); I++) {
+        Pool.async([this, &Paths, &Modules, &Errors, I]() {
+          auto TSM = loadBitcodeFile(Paths[I]);
+          if (TSM) {
+            Modules[I] = std::move(*TSM);
+          } else {
+            Errors[I] = llvm::toString(TSM.takeError());
+          }
+        });
+      }
+      Pool.wait();
+    }
+
+    // in lean mode the modules are compiled once all of them are added, so they can refer to
+    // each other regardless of their order
+    llvm::orc::SymbolLookupSet Defined;
+    for (size_t I = 0; I < Paths.size(); I++) {
+      if (!Errors[I].empty()) {
+        return llvm::make_error<llvm::StringError>(Paths[I] + ": " + Errors[I],
+                                                   llvm::inconvertibleErrorCode());
+      }
+      if (auto Err = addModuleWithoutCompiling(std::move(Modules[I]), Defined)) return Err;
+    }
+    return compileNow(std::move(Defined));
   }
 
   llvm::Expected<llvm::orc::ExecutorSymbolDef> lookup(llvm::StringRef Name) {
-    return ES.lookup({&MainJD}, Mangle(Name.str()));
+    return ES.lookup({&MainJD}, Mangle(Name));
+  }
+
+  /**
+   * Print the memory used by each loaded module, the size of its object file and of the code and
+   * data loaded from it, followed by the copies of object files kept for snapshots and for
+   * describing faults, and the resident set of the process.
+   */
+  void printMemoryReport(llvm::raw_ostream &OS) const {
+    {
+      std::lock_guard<std::mutex> Lock(MemoryMutex);
+      for (const auto &Entry : MemoryReport) {
+        const ModuleMemory &Memory = Entry.getValue();
+        OS << Entry.getKey() << ": object " << Memory.ObjectBytes / 1024 << " KiB, loaded "
+           << Memory.LoadedBytes / 1024 << " KiB\n";
+      }
+    }
+    uint64_t SnapshotBytes = 0;
+    {
+      std::lock_guard<std::mutex> Lock(SnapshotMutex);
+      for (const auto &Object : SnapshotObjects) SnapshotBytes += Object->getBufferSize();
+    }
+    OS << "snapshot object copies: " << SnapshotBytes / 1024 << " KiB\n";
+    OS << "fault symbolizer object copies: " << Symbolizer.debugObjectBytes() / 1024 << " KiB\n";
+    uint64_t Resident = residentBytes();
+    OS << "resident: " << Resident / 1024 << " KiB, "
+       << (static_cast<int64_t>(Resident) - static_cast<int64_t>(resident_at_creation)) / 1024
+       << " KiB since the JIT was created\n";
+  }
+
+  /**
+   * Make the host function or variable at `Address` available to generated code as `Name`.
+   */
+  llvm::Error addHostSymbol(llvm::StringRef Name, const void *Address) {
+    llvm::orc::SymbolMap Symbols;
+    Symbols[Mangle(Name)] = llvm::orc::ExecutorSymbolDef(
+        llvm::orc::ExecutorAddr::fromPtr(Address),
+        llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable);
+    return MainJD.define(llvm::orc::absoluteSymbols(std::move(Symbols)));
+  }
+
+  /**
+   * Resolve `Names` in the host process once and make them available to generated code.
+   * @param IgnoreMissing skip names that cannot be found instead of returning an error
+   */
+  llvm::Error addHostSymbols(llvm::ArrayRef<llvm::StringRef> Names, bool IgnoreMissing = false) {
+    llvm::sys::DynamicLibrary Process = llvm::sys::DynamicLibrary::getPermanentLibrary(nullptr);
+    llvm::orc::SymbolMap Symbols;
+    for (llvm::StringRef Name : Names) {
+      void *Address = Process.getAddressOfSymbol(Name.str().c_str());
+      if (!Address) {
+        if (IgnoreMissing) continue;
+        return llvm::make_error<llvm::StringError>("Host symbol " + Name + " not found",
+                                                   llvm::inconvertibleErrorCode());
+      }
+      Symbols[Mangle(Name)] = llvm::orc::ExecutorSymbolDef(
+          llvm::orc::ExecutorAddr::fromPtr(Address),
+          llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable);
+    }
+    return MainJD.define(llvm::orc::absoluteSymbols(std::move(Symbols)));
+  }
+
+  /**
+   * Look up `Name` as a function with the C++ signature `Sig`, e.g. `getFunction<int(int*, int)>`.
+   * Returns an error if the IR function type of `Sig` differs from the one `Name` was defined
+   * with. Only the IR-level shape is checked: the number of parameters, integer widths, and
+   * integer vs floating point vs pointer. Signedness and pointee types do not exist in IR, so
+   * `int` vs `unsigned` or `int*` vs `double*` are not caught.
+   */
+  template <typename Sig>
+  llvm::Expected<JITFunction<Sig>> getFunction(llvm::StringRef Name) {
+    auto Entry = ExportedSignatures.find(Name);
+    if (Entry == ExportedSignatures.end()) {
+      return llvm::make_error<llvm::StringError>("No IR function type is known for " + Name,
+                                                 llvm::inconvertibleErrorCode());
+    }
+    std::string Requested;
+    {
+      std::lock_guard<std::mutex> Lock(SignatureMutex);
+      Requested = JITFunction<Sig>::getIRSignature(SignatureContext);
+    }
+    if (Requested != Entry->getValue()) {
+      return llvm::make_error<llvm::StringError>(Name + " has IR type " + Entry->getValue() +
+                                                     " but was requested as " + Requested,
+                                                 llvm::inconvertibleErrorCode());
+    }
+
+    auto Symbol = lookup(Name);
+    if (!Symbol) return Symbol.takeError();
+    return JITFunction<Sig>(Symbol->getAddress().toPtr<typename JITFunction<Sig>::Pointer>());
+  }
+
+  /**
+   * Call `F`, returning an error that names the faulting function and .ll line instead of
+   * crashing the process if it faults. See `guardedCall` in GuardedCall.hpp.
+   */
+  template <typename R, typename... Params, typename... Args>
+  auto guardedCall(const JITFunction<R(Params...)> &F, Args &&...args) const {
+    return ::guardedCall(Symbolizer, F.get(), std::forward<Args>(args)...);
+  }
+
+  /**
+   * Keep a copy of every object file emitted from now on so that `saveSnapshot` can write it out.
+   * Must be called before any modules are added.
+   */
+  void enableSnapshotRecording() { record_snapshot_objects = true; }
+
+  /**
+   * Write every module added to MainJD to `Directory` as a single relocatable archive
+   * (snapshot.a) along with a manifest (snapshot.manifest) of the target the objects were
+   * compiled for, and of the exported symbols and their IR function types. Modules which have not
+   * been compiled yet are compiled first. Requires `enableSnapshotRecording`.
+   */
+  llvm::Error saveSnapshot(llvm::StringRef Directory) {
+    if (!record_snapshot_objects) {
+      return llvm::make_error<llvm::StringError>("Snapshot recording is disabled",
+                                                 llvm::inconvertibleErrorCode());
+    }
+
+    // object files are only emitted on materialization, so force everything to be compiled
+    llvm::orc::SymbolLookupSet Symbols;
+    for (const auto &Entry : DefinedSymbols) {
+      Symbols.add(Mangle(Entry.getKey()));
+    }
+    if (auto Result = ES.lookup(
+            llvm::orc::makeJITDylibSearchOrder({&MainJD},
+                                               llvm::orc::JITDylibLookupFlags::MatchAllSymbols),
+            std::move(Symbols));
+        !Result) {
+      return Result.takeError();
+    }
+
+    if (auto EC = llvm::sys::fs::create_directories(Directory)) {
+      return llvm::errorCodeToError(EC);
+    }
+
+    llvm::SmallString<128> ArchivePath(Directory);
+    llvm::sys::path::append(ArchivePath, "snapshot.a");
+    llvm::SmallString<128> ManifestPath(Directory);
+    llvm::sys::path::append(ManifestPath, "snapshot.manifest");
+
+    {
+      std::lock_guard<std::mutex> Lock(SnapshotMutex);
+      std::vector<llvm::MemoryBufferRef> Objects(LoadedSnapshotObjects);
+      for (const auto &Object : SnapshotObjects) Objects.push_back(Object->getMemBufferRef());
+
+      // NewArchiveMember only references its name, so the names must outlive the members
+      std::vector<std::string> MemberNames;
+      MemberNames.reserve(Objects.size());
+      std::vector<llvm::NewArchiveMember> Members;
+      for (const auto &Object : Objects) {
+        MemberNames.push_back(std::to_string(Members.size()) + ".o");
+        llvm::NewArchiveMember Member;
+        Member.Buf = llvm::MemoryBuffer::getMemBuffer(Object, /*RequiresNullTerminator=*/false);
+        Member.MemberName = MemberNames.back();
+        Members.push_back(std::move(Member));
+      }
+      // the BSD format pads the member names so that every member is 8 byte aligned, which lets
+      // `loadSnapshot` use the objects in place. GNU archive members are only 2 byte aligned.
+      if (auto Err = llvm::writeArchive(ArchivePath, Members, /*WriteSymtab=*/true,
+                                        llvm::object::Archive::K_BSD, /*Deterministic=*/true,
+                                        /*Thin=*/false)) {
+        return Err;
+      }
+    }
+
+    std::error_code EC;
+    llvm::raw_fd_ostream Manifest(ManifestPath, EC, llvm::sys::fs::OpenFlags::OF_Text);
+    if (EC) return llvm::errorCodeToError(EC);
+    for (const auto &[Key, Value] : snapshotTarget()) {
+      Manifest << "!" << Key << "\t" << Value << "\n";
+    }
+    Manifest << "# symbol\tsignature\n";
+    for (const auto &Entry : ExportedSignatures) {
+      Manifest << Entry.getKey() << "\t" << Entry.getValue() << "\n";
+    }
+    return llvm::Error::success();
+  }
+
+  /**
+   * Load a snapshot written by `saveSnapshot` into MainJD. The archive is memory mapped and its
+   * object files are handed straight to the linking layer, so none of the IR layers run and the
+   * objects are neither copied nor dumped. Object files are only linked once one of their
+   * symbols is looked up. Snapshots compiled for another target, CPU or instrumentation mode are
+   * rejected since their code may not run here, as are snapshots whose archive cannot be read,
+   * before any of their symbols or objects are added.
+   */
+  llvm::Error loadSnapshot(llvm::StringRef Directory) {
+    llvm::SmallString<128> ArchivePath(Directory);
+    llvm::sys::path::append(ArchivePath, "snapshot.a");
+    llvm::SmallString<128> ManifestPath(Directory);
+    llvm::sys::path::append(ManifestPath, "snapshot.manifest");
+
+    auto ManifestBuffer = llvm::MemoryBuffer::getFile(ManifestPath, /*IsText=*/true);
+    if (!ManifestBuffer) return llvm::errorCodeToError(ManifestBuffer.getError());
+    llvm::SmallVector<llvm::StringRef, 0> Lines;
+    (*ManifestBuffer)->getBuffer().split(Lines, '\n', /*MaxSplit=*/-1, /*KeepEmpty=*/false);
+    llvm::StringMap<std::string> Target;
+    for (llvm::StringRef Line : Lines) {
+      if (Line.consume_front("!")) {
+        auto [Key, Value] = Line.split('\t');
+        Target[Key] = Value.str();
+      }
+    }
+    for (const auto &[Key, Value] : snapshotTarget()) {
+      auto It = Target.find(Key);
+      if (It == Target.end() || It->getValue() != Value) {
+        return llvm::make_error<llvm::StringError>(
+            "Snapshot " + Directory + " was compiled for " + Key + " '" +
+                (It == Target.end() ? std::string("unknown") : It->getValue()) + "', not '" +
+                Value + "'",
+            llvm::inconvertibleErrorCode());
+      }
+    }
+    std::vector<std::pair<llvm::StringRef, llvm::StringRef>> Signatures;
+    for (llvm::StringRef Line : Lines) {
+      if (Line.startswith("#") || Line.startswith("!")) continue;
+      Signatures.push_back(Line.split('\t'));
+    }
+
+    auto ArchiveBuffer = llvm::MemoryBuffer::getFile(ArchivePath, /*IsText=*/false,
+                                                     /*RequiresNullTerminator=*/false);
+    if (!ArchiveBuffer) return llvm::errorCodeToError(ArchiveBuffer.getError());
+    auto Archive = llvm::object::Archive::create((*ArchiveBuffer)->getMemBufferRef());
+    if (!Archive) return Archive.takeError();
+
+    std::vector<llvm::MemoryBufferRef> Members;
+    llvm::Error Err = llvm::Error::success();
+    for (const auto &Child : (*Archive)->children(Err)) {
+      auto ChildBuffer = Child.getMemoryBufferRef();
+      if (!ChildBuffer) {
+        llvm::consumeError(std::move(Err));
+        return ChildBuffer.takeError();
+      }
+      // reject the whole snapshot before adding anything if any member is not an object file
+      if (auto Object = llvm::object::ObjectFile::createObjectFile(*ChildBuffer); !Object) {
+        llvm::consumeError(std::move(Err));
+        return Object.takeError();
+      }
+      Members.push_back(*ChildBuffer);
+    }
+    if (Err) return Err;
+
+    for (const auto &[Name, Signature] : Signatures) {
+      ExportedSignatures[Name] = Signature.str();
+    }
+    std::lock_guard<std::mutex> Lock(SnapshotMutex);
+    SnapshotBuffers.push_back(std::move(*ArchiveBuffer));
+    for (llvm::MemoryBufferRef Member : Members) {
+      // `saveSnapshot` aligns every member, but the object file parser needs the ELF headers to
+      // be naturally aligned, so copy any member of an archive written some other way
+      if (reinterpret_cast<uintptr_t>(Member.getBufferStart()) % alignof(uint64_t) != 0) {
+        SnapshotBuffers.push_back(llvm::MemoryBuffer::getMemBufferCopy(
+            Member.getBuffer(), Member.getBufferIdentifier()));
+        Member = SnapshotBuffers.back()->getMemBufferRef();
+      }
+      // kept so that saving a snapshot again writes these objects out as well
+      LoadedSnapshotObjects.push_back(Member);
+      if (auto AddErr = LinkingLayer.add(
+              MainJD, llvm::MemoryBuffer::getMemBuffer(Member, /*RequiresNullTerminator=*/false))) {
+        return AddErr;
+      }
+    }
+    return llvm::Error::success();
   }
 
  private:
+  static InstrumentationMode checkInstrumentationMode(InstrumentationMode Mode) {
+    if (Mode == InstrumentationMode::AddressSanitizer &&
+        !llvm::sys::DynamicLibrary::getPermanentLibrary(nullptr).getAddressOfSymbol(
+            "__asan_report_load4")) {
+      std::cout << "AddressSanitizer instrumentation needs the host to be built with "
+                   "-fsanitize=address (make ASAN=1), generated code will not be instrumented."
+                << std::endl;
+      return InstrumentationMode::None;
+    }
+    return Mode;
+  }
+
+  // The compiler runtime helpers the backend calls for operations the target has no instruction
+  // for, like 128 bit division or `llvm.powi`, made available to generated code by the
+  // constructor. Their addresses are taken here rather than resolved by name, since the host only
+  // links them in, and possibly not as exported symbols, if something refers to them.
+  llvm::Error addBuiltinHostSymbols() {
+    const std::pair<llvm::StringRef, const void *> Builtins[] = {
+#ifdef __SIZEOF_INT128__
+        {"__divti3", reinterpret_cast<const void *>(&__divti3)},
+        {"__udivti3", reinterpret_cast<const void *>(&__udivti3)},
+        {"__modti3", reinterpret_cast<const void *>(&__modti3)},
+        {"__umodti3", reinterpret_cast<const void *>(&__umodti3)},
+        {"__fixdfti", reinterpret_cast<const void *>(&__fixdfti)},
+        {"__fixunsdfti", reinterpret_cast<const void *>(&__fixunsdfti)},
+        {"__floattidf", reinterpret_cast<const void *>(&__floattidf)},
+        {"__floatuntidf", reinterpret_cast<const void *>(&__floatuntidf)},
+#endif
+        {"__powidf2", reinterpret_cast<const void *>(&__powidf2)},
+        {"__powisf2", reinterpret_cast<const void *>(&__powisf2)},
+    };
+    llvm::orc::SymbolMap Symbols;
+    for (const auto &[Name, Address] : Builtins) {
+      Symbols[Mangle(Name)] = llvm::orc::ExecutorSymbolDef(
+          llvm::orc::ExecutorAddr::fromPtr(Address),
+          llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable);
+    }
+    return MainJD.define(llvm::orc::absoluteSymbols(std::move(Symbols)));
+  }
+
+  // the per-module half of LTO, run on each module of a batch before they are linked together
+  static void optimizeForLTOPreLink(llvm::Module &M, llvm::TargetMachine &TM,
+                                    llvm::OptimizationLevel Level) {
+    llvm::LoopAnalysisManager LAM;
+    llvm::FunctionAnalysisManager FAM;
+    llvm::CGSCCAnalysisManager CGAM;
+    llvm::ModuleAnalysisManager MAM;
+    llvm::PassBuilder PB(&TM);
+
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    PB.buildLTOPreLinkDefaultPipeline(Level).run(M, MAM);
+  }
+
   static llvm::Expected<llvm::orc::ThreadSafeModule> optimizeModule(
-      llvm::orc::ThreadSafeModule TSM, std::unique_ptr<llvm::TargetMachine> TM) {
-    TSM.withModuleDo([&TM](llvm::Module &M) {
+      llvm::orc::ThreadSafeModule TSM, std::unique_ptr<llvm::TargetMachine> TM,
+      InstrumentationMode Mode) {
+    TSM.withModuleDo([&TM, Mode](llvm::Module &M) {
       llvm::LoopAnalysisManager LAM;
       llvm::FunctionAnalysisManager FAM;
       llvm::CGSCCAnalysisManager CGAM;
@@ -155,7 +863,35 @@ class MyJIT {
       PB.registerLoopAnalyses(LAM);
       PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
 
-      llvm::ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2);
+      // modules linked together by `commitBatch` are optimized as a whole with the LTO pipeline
+      llvm::ModulePassManager Pipeline;
+      if (auto *LTOLevel = llvm::mdconst::extract_or_null<llvm::ConstantInt>(
+              M.getModuleFlag("jit-lto-level"))) {
+        Pipeline = PB.buildLTODefaultPipeline(LTOLevel->getZExtValue() >= 3
+                                                  ? llvm::OptimizationLevel::O3
+                                                  : llvm::OptimizationLevel::O2,
+                                              /*ExportSummary=*/nullptr);
+      } else {
+        Pipeline = PB.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2);
+      }
+
+      llvm::ModulePassManager MPM;
+      if (Mode == InstrumentationMode::BoundsChecking) {
+        MPM.addPass(llvm::createModuleToFunctionPassAdaptor(llvm::BoundsCheckingPass()));
+      }
+      MPM.addPass(std::move(Pipeline));
+      if (Mode == InstrumentationMode::AddressSanitizer) {
+        // ASan only instruments functions with the sanitize_address attribute
+        for (llvm::Function &F : M) {
+          if (!F.isDeclaration()) F.addFnAttr(llvm::Attribute::SanitizeAddress);
+        }
+        // the host process has already initialized the ASan runtime, and module constructors
+        // are not run for JIT'd modules
+        MPM.addPass(llvm::AddressSanitizerPass(llvm::AddressSanitizerOptions(),
+                                               /*UseGlobalGC=*/true, /*UseOdrIndicator=*/false,
+                                               llvm::AsanDtorKind::None,
+                                               llvm::AsanCtorKind::None));
+      }
 
       // Optimize the IR
       MPM.run(M, MAM);
@@ -163,6 +899,379 @@ class MyJIT {
     return TSM;
   }
 
+  llvm::Error addModuleWithoutVerification(llvm::orc::ThreadSafeModule TSM) {
+    llvm::orc::SymbolLookupSet Defined;
+    if (auto Err = addModuleWithoutCompiling(std::move(TSM), Defined)) return Err;
+    return compileNow(std::move(Defined));
+  }
+
+  // Adds the module without compiling it in lean mode, adding the symbols to look up to compile
+  // it to Defined instead, so that modules referring to each other can be compiled together.
+  llvm::Error addModuleWithoutCompiling(llvm::orc::ThreadSafeModule TSM,
+                                        llvm::orc::SymbolLookupSet &Defined) {
+    if (batching) {
+      PendingModules.push_back(std::move(TSM));
+      return llvm::Error::success();
+    }
+    // entry points must be created before the module is added so that their symbols are known
+    if (auto Err = TSM.withModuleDo([this](llvm::Module &M) { return addBatchEntryPoints(M); })) {
+      return Err;
+    }
+    TSM.withModuleDo([this](llvm::Module &M) { recordDefinitions(M); });
+    if (!lean_memory) return defineModule(std::move(TSM));
+
+    // everything the module defines is looked up so that it is compiled, and freed, right away
+    TSM.withModuleDo([this, &Defined](llvm::Module &M) {
+      for (llvm::GlobalValue &GV : M.global_values()) {
+        // the symbols the IR layer gives the module responsibility for
+        if (!GV.hasName() || GV.isDeclaration() || GV.hasLocalLinkage() ||
+            GV.hasAvailableExternallyLinkage() || GV.hasAppendingLinkage()) {
+          continue;
+        }
+        Defined.add(Mangle(GV.getName()));
+      }
+    });
+    return defineModule(std::move(TSM));
+  }
+
+  // compiles the modules defining Defined in lean mode, failing if they refer to a symbol that
+  // is not defined yet
+  llvm::Error compileNow(llvm::orc::SymbolLookupSet Defined) {
+    if (Defined.empty()) return llvm::Error::success();
+    auto Compiled = ES.lookup(
+        llvm::orc::makeJITDylibSearchOrder({&MainJD},
+                                           llvm::orc::JITDylibLookupFlags::MatchAllSymbols),
+        std::move(Defined));
+    if (!Compiled) return Compiled.takeError();
+    return llvm::Error::success();
+  }
+
+  // Modules loaded lazily from bitcode are split up as their symbols are looked up, see
+  // `BitcodePartitionMaterializationUnit`; anything else is compiled as a whole.
+  llvm::Error defineModule(llvm::orc::ThreadSafeModule TSM) {
+    bool Lazy = TSM.withModuleDo([this](llvm::Module &M) {
+      if (!M.getMaterializer()) return false;
+      PromoteLocals(M);
+      return true;
+    });
+    if (!Lazy) return PrintGeneratedIRLayer.add(MainJD, std::move(TSM));
+    return MainJD.define(
+        std::make_unique<BitcodePartitionMaterializationUnit>(*this, std::move(TSM)));
+  }
+
+  /**
+   * Owns the definitions of a lazily loaded bitcode module that have not been compiled yet. When
+   * some of them are looked up, only those and the definitions they reference are read from the
+   * bitcode and emitted as a partition, and the rest is handed to a new unit, see
+   * `emitBitcodePartition`.
+   */
+  class BitcodePartitionMaterializationUnit : public llvm::orc::IRMaterializationUnit {
+   public:
+    BitcodePartitionMaterializationUnit(MyJIT &JIT, llvm::orc::ThreadSafeModule TSM)
+        : IRMaterializationUnit(JIT.ES, *JIT.PrintGeneratedIRLayer.getManglingOptions(),
+                                std::move(TSM)),
+          JIT(JIT) {}
+    BitcodePartitionMaterializationUnit(MyJIT &JIT, llvm::orc::ThreadSafeModule TSM,
+                                        Interface I, SymbolNameToDefinitionMap Definitions)
+        : IRMaterializationUnit(std::move(TSM), std::move(I), std::move(Definitions)),
+          JIT(JIT) {}
+
+   private:
+    void materialize(std::unique_ptr<llvm::orc::MaterializationResponsibility> R) override {
+      JIT.emitBitcodePartition(std::move(R), std::move(TSM), std::move(SymbolToDefinition));
+    }
+
+    MyJIT &JIT;
+  };
+
+  void emitBitcodePartition(std::unique_ptr<llvm::orc::MaterializationResponsibility> R,
+                            llvm::orc::ThreadSafeModule TSM,
+                            llvm::orc::IRMaterializationUnit::SymbolNameToDefinitionMap Definitions) {
+    llvm::orc::ThreadSafeContext Ctx = TSM.getContext();
+    llvm::orc::SymbolFlagsMap Remaining = R->getSymbols();
+    auto Partition = TSM.withModuleDo(
+        [&](llvm::Module &M) -> llvm::Expected<std::unique_ptr<llvm::Module>> {
+          // Modules with aliases, or lookups of the initializer symbol which has no definition of
+          // its own, are rare enough not to be worth splitting, so everything left is emitted.
+          if (!M.alias_empty() || !M.ifunc_empty()) return nullptr;
+          std::vector<llvm::GlobalValue *> Worklist;
+          for (const llvm::orc::SymbolStringPtr &Name : R->getRequestedSymbols()) {
+            auto It = Definitions.find(Name);
+            if (It == Definitions.end()) return nullptr;
+            Worklist.push_back(It->second);
+          }
+          llvm::SmallPtrSet<llvm::GlobalValue *, 16> Unemitted;
+          for (const auto &Definition : Definitions) Unemitted.insert(Definition.second);
+
+          // the requested definitions and, transitively, every unemitted definition they use
+          llvm::SmallPtrSet<llvm::GlobalValue *, 16> Extract;
+          llvm::SmallPtrSet<const llvm::Constant *, 32> Visited;
+          std::function<void(llvm::Value *)> Use = [&](llvm::Value *V) {
+            if (auto *GV = llvm::dyn_cast<llvm::GlobalValue>(V)) {
+              if (Unemitted.count(GV)) Worklist.push_back(GV);
+            } else if (auto *C = llvm::dyn_cast<llvm::Constant>(V)) {
+              if (!Visited.insert(C).second) return;
+              for (llvm::Value *Op : C->operands()) Use(Op);
+            }
+          };
+          while (!Worklist.empty()) {
+            llvm::GlobalValue *GV = Worklist.back();
+            Worklist.pop_back();
+            if (!Extract.insert(GV).second) continue;
+            if (auto Err = GV->materialize()) return std::move(Err);
+            if (auto *Var = llvm::dyn_cast<llvm::GlobalVariable>(GV)) {
+              if (Var->hasInitializer()) Use(Var->getInitializer());
+            } else if (auto *F = llvm::dyn_cast<llvm::Function>(GV)) {
+              for (llvm::Instruction &I : llvm::instructions(*F)) {
+                for (llvm::Value *Op : I.operands()) Use(Op);
+              }
+            }
+          }
+
+          llvm::ValueToValueMapTy VMap;
+          std::unique_ptr<llvm::Module> Sub = llvm::CloneModule(
+              M, VMap, [&Extract](const llvm::GlobalValue *GV) { return Extract.count(GV) != 0; });
+          Sub->setModuleIdentifier(M.getModuleIdentifier() + "." +
+                                   std::to_string(partition_count++));
+          for (llvm::Function &F : llvm::make_early_inc_range(Sub->functions())) {
+            if (F.isDeclaration() && F.use_empty()) F.eraseFromParent();
+          }
+          for (llvm::GlobalVariable &Var : llvm::make_early_inc_range(Sub->globals())) {
+            if (Var.isDeclaration() && Var.use_empty()) Var.eraseFromParent();
+          }
+          if (llvm::verifyModule(*Sub, &llvm::errs())) {
+            return llvm::make_error<llvm::StringError>("Module verification failed",
+                                                       llvm::inconvertibleErrorCode());
+          }
+
+          // the extracted definitions now live in the partition, leave declarations behind
+          for (auto It = Definitions.begin(); It != Definitions.end();) {
+            if (!Extract.count(It->second)) {
+              ++It;
+              continue;
+            }
+            Remaining.erase(It->first);
+            It = Definitions.erase(It);
+          }
+          for (llvm::GlobalValue *GV : Extract) {
+            if (auto *F = llvm::dyn_cast<llvm::Function>(GV)) {
+              F->deleteBody();
+            } else if (auto *Var = llvm::dyn_cast<llvm::GlobalVariable>(GV)) {
+              Var->setInitializer(nullptr);
+              Var->setLinkage(llvm::GlobalValue::ExternalLinkage);
+            }
+            GV->setComdat(nullptr);
+          }
+          return std::move(Sub);
+        });
+    if (!Partition) {
+      ES.reportError(Partition.takeError());
+      R->failMaterialization();
+      return;
+    }
+    if (!*Partition) {
+      PrintGeneratedIRLayer.emit(std::move(R), std::move(TSM));
+      return;
+    }
+
+    if (!Remaining.empty()) {
+      llvm::orc::SymbolStringPtr InitSymbol = R->getInitializerSymbol();
+      if (InitSymbol && !Remaining.count(InitSymbol)) InitSymbol = nullptr;
+      auto Rest = std::make_unique<BitcodePartitionMaterializationUnit>(
+          *this, std::move(TSM),
+          llvm::orc::MaterializationUnit::Interface(std::move(Remaining), std::move(InitSymbol)),
+          std::move(Definitions));
+      if (auto Err = R->replace(std::move(Rest))) {
+        ES.reportError(std::move(Err));
+        R->failMaterialization();
+        return;
+      }
+    }
+    PrintGeneratedIRLayer.emit(std::move(R),
+                               llvm::orc::ThreadSafeModule(std::move(*Partition), Ctx));
+  }
+
+  // Generated code is compiled for the host, so IR written for another target is rejected
+  // rather than silently compiled with the host's layout.
+  llvm::Error checkTarget(llvm::Module &M) const {
+    if (M.getDataLayout().isDefault()) {
+      M.setDataLayout(DL);
+    } else if (M.getDataLayout() != DL) {
+      return llvm::make_error<llvm::StringError>(
+          M.getModuleIdentifier() + " has data layout \"" + M.getDataLayoutStr() +
+              "\", the JIT compiles for \"" + DL.getStringRepresentation() + "\"",
+          llvm::inconvertibleErrorCode());
+    }
+    const llvm::Triple &Host = JTMB.getTargetTriple();
+    if (M.getTargetTriple().empty()) {
+      M.setTargetTriple(Host.str());
+      return llvm::Error::success();
+    }
+    llvm::Triple Target(M.getTargetTriple());
+    if (Target.getArch() != Host.getArch() || Target.getOS() != Host.getOS()) {
+      return llvm::make_error<llvm::StringError>(
+          M.getModuleIdentifier() + " has target triple " + Target.str() +
+              ", the JIT compiles for " + Host.str(),
+          llvm::inconvertibleErrorCode());
+    }
+    return llvm::Error::success();
+  }
+
+  llvm::Error addBatchEntryPoints(llvm::Module &M) const {
+    for (const auto &Entry : BatchEntryPoints) {
+      llvm::Function *F = M.getFunction(Entry.getKey());
+      if (!F || F->isDeclaration()) continue;
+      if (auto Batch = createBatchEntryPoint(*F); !Batch) return Batch.takeError();
+    }
+    return llvm::Error::success();
+  }
+
+  llvm::Expected<llvm::orc::ThreadSafeModule> loadBitcodeFile(llvm::StringRef Path) const {
+    auto Ctx = std::make_unique<llvm::LLVMContext>();
+    llvm::SMDiagnostic Diag;
+    std::unique_ptr<llvm::Module> M = llvm::getLazyIRFileModule(Path, Diag, *Ctx);
+    if (!M) return diagnosticError(Diag);
+    if (auto Err = checkTarget(*M)) return std::move(Err);
+    return llvm::orc::ThreadSafeModule(std::move(M), std::move(Ctx));
+  }
+
+  static llvm::Error diagnosticError(const llvm::SMDiagnostic &Diag) {
+    std::string Message;
+    llvm::raw_string_ostream OS(Message);
+    Diag.print("", OS, /*ShowColors=*/false);
+    return llvm::make_error<llvm::StringError>(OS.str(), llvm::inconvertibleErrorCode());
+  }
+
+  // a module loaded with `addBitcodeFile` that is emitted as a whole, see `emitBitcodePartition`,
+  // still has the bodies of its remaining functions in the bitcode, and is verified once they
+  // have been read
+  static llvm::Error materializeLazyModule(llvm::orc::ThreadSafeModule &TSM) {
+    return TSM.withModuleDo([](llvm::Module &M) -> llvm::Error {
+      if (!M.getMaterializer()) return llvm::Error::success();
+      if (auto Err = M.materializeAll()) return Err;
+      if (llvm::verifyModule(M, &llvm::errs())) {
+        return llvm::make_error<llvm::StringError>("Module verification failed",
+                                                   llvm::inconvertibleErrorCode());
+      }
+      return llvm::Error::success();
+    });
+  }
+
+  // everything the code in a snapshot was compiled for, `loadSnapshot` requires it to match
+  std::vector<std::pair<std::string, std::string>> snapshotTarget() const {
+    return {{"triple", JTMB.getTargetTriple().str()},
+            {"cpu", JTMB.getCPU()},
+            {"features", JTMB.getFeatures().getString()},
+            {"instrumentation", std::to_string(static_cast<int>(instrumentation_mode))}};
+  }
+
+  void recordSnapshotObject(const llvm::MemoryBuffer &Object) {
+    std::lock_guard<std::mutex> Lock(SnapshotMutex);
+    SnapshotObjects.push_back(
+        llvm::MemoryBuffer::getMemBufferCopy(Object.getBuffer(), Object.getBufferIdentifier()));
+  }
+
+  // resident set size of the process, 0 where /proc is not available
+  static uint64_t residentBytes() {
+    auto Statm = llvm::MemoryBuffer::getFileAsStream("/proc/self/statm");
+    if (!Statm) return 0;
+    // the second field is the number of resident pages
+    uint64_t Pages = 0;
+    if ((*Statm)->getBuffer().split(' ').second.split(' ').first.getAsInteger(10, Pages)) return 0;
+    return Pages * llvm::sys::Process::getPageSizeEstimate();
+  }
+
+  // the compiler names the object of a module "<module name>-jitted-objectbuffer"
+  static llvm::StringRef objectModuleName(llvm::StringRef BufferIdentifier) {
+    BufferIdentifier.consume_back("-jitted-objectbuffer");
+    return BufferIdentifier;
+  }
+
+  void recordObjectSize(const llvm::MemoryBuffer &Object) {
+    std::lock_guard<std::mutex> Lock(MemoryMutex);
+    MemoryReport[objectModuleName(Object.getBufferIdentifier())].ObjectBytes +=
+        Object.getBufferSize();
+  }
+
+  void recordObjectLoaded(const llvm::object::ObjectFile &Obj) {
+    uint64_t Loaded = 0;
+    for (const llvm::object::SectionRef &Section : Obj.sections()) {
+      if (Section.isText() || Section.isData() || Section.isBSS()) Loaded += Section.getSize();
+    }
+    std::lock_guard<std::mutex> Lock(MemoryMutex);
+    MemoryReport[objectModuleName(Obj.getFileName())].LoadedBytes += Loaded;
+  }
+
+  // Records every symbol M defines, and the IR function type of those that are exported, i.e. the
+  // ones `lookup` and `getFunction` can find.
+  void recordDefinitions(const llvm::Module &M) {
+    for (const llvm::GlobalValue &GV : M.global_values()) {
+      // the symbols the IR layer gives the module responsibility for
+      if (!GV.hasName() || GV.isDeclaration() || GV.hasLocalLinkage() ||
+          GV.hasAvailableExternallyLinkage() || GV.hasAppendingLinkage()) {
+        continue;
+      }
+      DefinedSymbols.insert(GV.getName());
+    }
+    for (const llvm::Function &F : M.functions()) {
+      if (F.isDeclaration() || F.hasLocalLinkage() || F.hasHiddenVisibility()) continue;
+      std::string Signature;
+      llvm::raw_string_ostream OS(Signature);
+      F.getFunctionType()->print(OS);
+      ExportedSignatures[F.getName()] = OS.str();
+    }
+  }
+
+  // Only the runtime globals that M references are linked in. They are internalized so that the
+  // optimizer is free to inline them and drop the out of line copies, and their names are
+  // returned in LinkedNames so that anything still unused after optimization can be stripped.
+  static llvm::Error linkRuntimeLibrary(llvm::Module &M, llvm::MemoryBufferRef Runtime,
+                                        std::vector<std::string> &LinkedNames) {
+    auto RT = llvm::getLazyBitcodeModule(Runtime, M.getContext());
+    if (!RT) return RT.takeError();
+
+    // the runtime is compiled ahead of time for a generic target, drop its target attributes so
+    // they do not block inlining and the runtime is compiled for the host like everything else
+    for (llvm::Function &F : **RT) {
+      F.removeFnAttr("target-cpu");
+      F.removeFnAttr("target-features");
+      F.removeFnAttr("tune-cpu");
+    }
+    (*RT)->setDataLayout(M.getDataLayout());
+    (*RT)->setTargetTriple(M.getTargetTriple());
+
+    bool link_failed = llvm::Linker::linkModules(
+        M, std::move(*RT), llvm::Linker::Flags::LinkOnlyNeeded,
+        [&LinkedNames](llvm::Module &M, const llvm::StringSet<> &GVS) {
+          for (const auto &Entry : GVS) LinkedNames.push_back(Entry.getKey().str());
+          llvm::internalizeModule(M, [&GVS](const llvm::GlobalValue &GV) {
+            return !GV.hasName() || GVS.count(GV.getName()) == 0;
+          });
+        });
+    if (link_failed) {
+      return llvm::make_error<llvm::StringError>("Linking the runtime library failed",
+                                                 llvm::inconvertibleErrorCode());
+    }
+    return llvm::Error::success();
+  }
+
+  static void stripUnusedRuntimeGlobals(llvm::Module &M, const std::vector<std::string> &Names) {
+    // erasing a global can leave globals it referenced unused, so repeat until nothing changes
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (const std::string &Name : Names) {
+        llvm::GlobalValue *GV = M.getNamedValue(Name);
+        if (!GV || !GV->hasLocalLinkage()) continue;
+        GV->removeDeadConstantUsers();
+        if (GV->use_empty()) {
+          GV->eraseFromParent();
+          changed = true;
+        }
+      }
+    }
+  }
+
   // based on InstructionNamerPass, but as a transform because we do not want to do any IR
   // optimization so we can print IR that is the same as the generated IR, just with renamed
   // instructions for readability
@@ -185,10 +1294,24 @@ class MyJIT {
     return TSM;
   }
 
+  // Names and debug info are only needed to read the IR, and take up memory until the module is
+  // freed after codegen.
+  static void stripNamesAndDebugInfo(llvm::Module &M) {
+    llvm::StripDebugInfo(M);
+    for (llvm::Function &F : M) {
+      for (llvm::Argument &Arg : F.args()) Arg.setName("");
+      for (llvm::BasicBlock &BB : F) {
+        BB.setName("");
+        for (llvm::Instruction &I : BB) I.setName("");
+      }
+    }
+  }
+
   static llvm::Expected<llvm::orc::ThreadSafeModule> printIR(llvm::orc::ThreadSafeModule TSM,
                                                              const std::string &suffix = "",
-                                                             bool add_debug_info = false) {
-    TSM.withModuleDo([&suffix, &add_debug_info](llvm::Module &m) {
+                                                             bool add_debug_info = false,
+                                                             bool verify_debug_info = false) {
+    auto Err = TSM.withModuleDo([&suffix, &add_debug_info, &verify_debug_info](llvm::Module &m) {
       std::error_code EC;
       const std::string output_directory = "generated_code/";
       const std::string output_file = m.getName().str() + suffix + ".ll";
@@ -196,11 +1319,14 @@ class MyJIT {
 
       llvm::raw_fd_ostream out(output_directory + output_file, EC,
                                llvm::sys::fs::OpenFlags::OF_None);
-      m.print(out, nullptr, false, true);
+      // the debug info points at the lines of the module as it is printed here
       if (add_debug_info) {
-        llvm::createDebugInfo(m, output_directory, output_file);
+        return llvm::createDebugInfo(m, out, output_directory, output_file, verify_debug_info);
       }
+      m.print(out, nullptr, false, true);
+      return llvm::Error::success();
     });
+    if (Err) return std::move(Err);
     return TSM;
   }
 };
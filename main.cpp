@@ -8,6 +8,7 @@
 #include <llvm/CodeGen/TargetPassConfig.h>
 #include <llvm/MC/TargetRegistry.h>
 
+#include "PerfCounters.hpp"
 #include "jit.hpp"
 
 static std::unique_ptr<llvm::LLVMContext> TheContext;
@@ -154,6 +155,50 @@ llvm::Function* createArraySumFunction() {
   return sumFunc;
 }
 
+// `square` and `sumOfSquares` live in separate modules so that the call between them can only be
+// inlined when the modules are batched together
+llvm::orc::ThreadSafeModule createSquareModule() {
+  auto Context = std::make_unique<llvm::LLVMContext>();
+  auto Module = std::make_unique<llvm::Module>("square_module", *Context);
+  Module->setTargetTriple(llvm::sys::getDefaultTargetTriple());
+  Module->setDataLayout(TheJIT->getDataLayout());
+  llvm::IRBuilder<> Builder(*Context);
+
+  llvm::Type* int32Type = Builder.getInt32Ty();
+  llvm::FunctionType* funcType = llvm::FunctionType::get(int32Type, {int32Type}, false);
+  llvm::Function* squareFunc =
+      llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, "square", *Module);
+  squareFunc->getArg(0)->setName("x");
+
+  Builder.SetInsertPoint(llvm::BasicBlock::Create(*Context, "entry", squareFunc));
+  Builder.CreateRet(Builder.CreateMul(squareFunc->getArg(0), squareFunc->getArg(0)));
+  return llvm::orc::ThreadSafeModule(std::move(Module), std::move(Context));
+}
+
+llvm::orc::ThreadSafeModule createSumOfSquaresModule() {
+  auto Context = std::make_unique<llvm::LLVMContext>();
+  auto Module = std::make_unique<llvm::Module>("sum_of_squares_module", *Context);
+  Module->setTargetTriple(llvm::sys::getDefaultTargetTriple());
+  Module->setDataLayout(TheJIT->getDataLayout());
+  llvm::IRBuilder<> Builder(*Context);
+
+  llvm::Type* int32Type = Builder.getInt32Ty();
+  llvm::FunctionType* squareType = llvm::FunctionType::get(int32Type, {int32Type}, false);
+  llvm::FunctionCallee squareFunc = Module->getOrInsertFunction("square", squareType);
+  llvm::FunctionType* funcType =
+      llvm::FunctionType::get(int32Type, {int32Type, int32Type}, false);
+  llvm::Function* sumFunc =
+      llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, "sumOfSquares", *Module);
+  sumFunc->getArg(0)->setName("a");
+  sumFunc->getArg(1)->setName("b");
+
+  Builder.SetInsertPoint(llvm::BasicBlock::Create(*Context, "entry", sumFunc));
+  llvm::Value* aSquared = Builder.CreateCall(squareFunc, {sumFunc->getArg(0)});
+  llvm::Value* bSquared = Builder.CreateCall(squareFunc, {sumFunc->getArg(1)});
+  Builder.CreateRet(Builder.CreateAdd(aSquared, bSquared));
+  return llvm::orc::ThreadSafeModule(std::move(Module), std::move(Context));
+}
+
 int main() {
   initializeLLVM();
   // inserting into a llvm::module created in `initializeLLVM`
@@ -161,18 +206,18 @@ int main() {
   createBuggyAddFunction();
   createArraySumFunction();
 
-  // compile our code
+  // compile our code, along with an `add_batch` entry point for `add`, keeping the object files
+  // so they can be saved as a snapshot below
+  TheJIT->requestBatchEntryPoint("add");
+  TheJIT->enableSnapshotRecording();
   auto TSM = llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext));
   ExitOnErr(TheJIT->addModule(std::move(TSM)));
 
-  auto add_symbol = ExitOnErr(TheJIT->lookup("add"));
-  int (*add_fp)(int, int) = add_symbol.getAddress().toPtr<int (*)(int, int)>();
-
-  auto array_sum_symbol = ExitOnErr(TheJIT->lookup("arraySum"));
-  int (*array_sum_fp)(int*, int) = array_sum_symbol.getAddress().toPtr<int (*)(int*, int)>();
-
-  auto buggy_add_symbol = ExitOnErr(TheJIT->lookup("buggyAdd"));
-  int (*buggy_add_fp)(int, int) = buggy_add_symbol.getAddress().toPtr<int (*)(int, int)>();
+  auto add_fp = ExitOnErr(TheJIT->getFunction<int(int, int)>("add"));
+  auto add_batch_fp =
+      ExitOnErr(TheJIT->getFunction<void(const int*, const int*, int*, int64_t)>("add_batch"));
+  auto array_sum_fp = ExitOnErr(TheJIT->getFunction<int(int*, int)>("arraySum"));
+  auto buggy_add_fp = ExitOnErr(TheJIT->getFunction<int(int, int)>("buggyAdd"));
 
   constexpr int KiB = 1024;
   constexpr int arr_size = 128 * KiB;
@@ -181,12 +226,62 @@ int main() {
     arr[i] = i + 1;
   }
 
+  PerfCounters counters;
   std::cout << "Adding 1+2 = " << add_fp(1, 2) << std::endl;
+  int lhs[] = {1, 2, 3, 4};
+  int rhs[] = {10, 20, 30, 40};
+  int sums[4];
+  add_batch_fp(lhs, rhs, sums, 4);
+  std::cout << "Adding {1, 2, 3, 4} + {10, 20, 30, 40} = {" << sums[0] << ", " << sums[1] << ", "
+            << sums[2] << ", " << sums[3] << "}" << std::endl;
   // for profiling, run this in a loop so it uses more CPU time relative to the rest of the program
   // for (size_t i = 0; i < 10000; i++) {
-  std::cout << "sum of {1, 2, ... 131072} = " << array_sum_fp(arr, arr_size) << std::endl;
+  std::cout << "sum of {1, 2, ... 131072} = "
+            << counters.measure("arraySum", arr_size * sizeof(int), array_sum_fp.get(), arr,
+                                arr_size)
+            << std::endl;
   // }
-  std::cout << "(with bugs) adding 1+2 = " << buggy_add_fp(1, 2) << std::endl;
+  counters.print(llvm::outs());
+  llvm::outs().flush();
+  // the fault is caught and reported instead of killing the process
+  auto buggy_result = TheJIT->guardedCall(buggy_add_fp, 1, 2);
+  if (buggy_result) {
+    std::cout << "(with bugs) adding 1+2 = " << *buggy_result << std::endl;
+  } else {
+    std::cout << "(with bugs) adding 1+2 failed: " << llvm::toString(buggy_result.takeError())
+              << std::endl;
+  }
 
+  // save the compiled code and load it into a fresh JIT, which does not run any of the IR layers
+  ExitOnErr(TheJIT->saveSnapshot("generated_code/snapshot"));
+  MyJIT RestoredJIT;
+  ExitOnErr(RestoredJIT.loadSnapshot("generated_code/snapshot"));
+  auto restored_add_fp = ExitOnErr(RestoredJIT.getFunction<int(int, int)>("add"));
+  std::cout << "Adding 1+2 from the snapshot = " << restored_add_fp(1, 2) << std::endl;
+
+  // link two modules together and optimize them as one, only `sumOfSquares` stays visible
+  TheJIT->beginBatch();
+  ExitOnErr(TheJIT->addModule(createSquareModule()));
+  ExitOnErr(TheJIT->addModule(createSumOfSquaresModule()));
+  ExitOnErr(TheJIT->commitBatch({"sumOfSquares"}, llvm::OptimizationLevel::O3));
+  auto sum_of_squares_fp = ExitOnErr(TheJIT->getFunction<int(int, int)>("sumOfSquares"));
+  std::cout << "3*3 + 4*4 from a batch = " << sum_of_squares_fp(3, 4) << std::endl;
+
+  TheJIT->printMemoryReport(llvm::outs());
+
+  // the modules of the batch above in a JIT that keeps nothing around for debugging, to compare
+  // with the report above
+  JITOptions LeanOptions;
+  LeanOptions.InsertPreoptDebugInfo = false;
+  LeanOptions.PrintGeneratedCode = false;
+  LeanOptions.DumpCompiledObjectFiles = false;
+  LeanOptions.LeanMemory = true;
+  MyJIT LeanJIT(LeanOptions);
+  // modules are compiled as they are added, so `square` has to be added first
+  ExitOnErr(LeanJIT.addModule(createSquareModule()));
+  ExitOnErr(LeanJIT.addModule(createSumOfSquaresModule()));
+  auto lean_sum_of_squares_fp = ExitOnErr(LeanJIT.getFunction<int(int, int)>("sumOfSquares"));
+  std::cout << "3*3 + 4*4 in lean mode = " << lean_sum_of_squares_fp(3, 4) << std::endl;
+  LeanJIT.printMemoryReport(llvm::outs());
   return 0;
 }
@@ -0,0 +1,14 @@
+#include "runtime.h"
+
+uint32_t rt_hash_u32(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x85ebca6bu;
+  x ^= x >> 13;
+  x *= 0xc2b2ae35u;
+  x ^= x >> 16;
+  return x;
+}
+
+int32_t rt_in_bounds(int64_t index, int64_t length) {
+  return (uint64_t)index < (uint64_t)length;
+}
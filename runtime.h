@@ -0,0 +1,27 @@
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+/**
+ * Runtime support library for JIT'd code. runtime.c is compiled both into the host executable,
+ * so JIT'd code can call the helpers once they are registered with `MyJIT::addHostSymbol`, and
+ * to bitcode (runtime.bc) which `MyJIT::setRuntimeLibrary` links into generated modules so the
+ * helpers can be inlined.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// murmur3 32-bit finalizer
+uint32_t rt_hash_u32(uint32_t x);
+
+/// returns 1 if 0 <= index < length, 0 otherwise
+int32_t rt_in_bounds(int64_t index, int64_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // RUNTIME_H